@@ -13,18 +13,49 @@
 #define strncmpi(a, b, n) strncasecmp(a, b, n)
 #endif
 
+// Parse a (possibly quoted) path value, trimming whitespace and quotes
+static bool parse_path_value(const char *value, std::string &result)
+{
+    // Trim off ending whitespace
+    size_t len = strlen(value);
+    if (len == 0) return false;
+    const char *end_value = value + len - 1;
+    while (end_value > value && isblank(*end_value)) --end_value;
+    // Get rid of quotes
+    if (*value == '"') ++value;
+    if (*end_value == '"') --end_value;
+    if (value >= end_value) return false;
+    result = std::string(value, end_value + 1);
+    return true;
+}
+
 // Default configuration
 Configuration::Configuration()
 {
     this->mass_tolerance = 0;
     this->gluc_digest = true;
+    this->precursor_mass = 0;
+    this->precursor_tolerance = 0.02;
+    this->peptide_table = false;
+    this->partial_scoring = false;
+    this->top_k = 10;
+    this->min_matched_targets = 1;
+    this->decoy_mode = DecoyMode::None;
     this->num_search_threads = 0;
     this->read_database_multithreaded = false;
+    this->time_budget_seconds = 0;
+    this->residue_budget = 0;
+    this->progress_interval_seconds = 10;
+    this->numa_placement = false;
+    this->thread_affinity = ThreadAffinity::None;
+    this->mass_prefilter = true;
+    this->prefilter_bin_width = 1.0;
+    this->result_cache_max_mb = 256;
+    this->database_index = false;
 }
 
-Configuration::Configuration(const char *filename)
+Configuration::Configuration(const char *filename) : Configuration()
 {
-    Configuration();
 
     std::ifstream input = std::ifstream(filename);
     if (!input) {
@@ -63,18 +94,11 @@ Configuration::Configuration(const char *filename)
 
         // Check against possible configuration (case insensitive)
         if (strcmpi(key.c_str(), "database") == 0) {
-            // Trim off ending whitespace
-            size_t len = strlen(value);
-            const char *end_value = value + len - 1;
-            while (*end_value && isblank(*end_value)) --end_value;
-            // Get rid of quotes
-            if (*value == '"') ++value;
-            if (*end_value == '"') --end_value;
-            if (value >= end_value) {
-                fprintf(stderr, "Invalid database value: '%s'\n", value - 1);
-                continue;
-            }
-            std::string value_str = std::string(value, end_value + 1);
+            std::string value_str;
+            if (!parse_path_value(value, value_str)) {
+                fprintf(stderr, "Invalid database value: '%s'\n", value);
+                continue;
+            }
             this->databases.push_back(value_str);
         }
         else if (strcmpi(key.c_str(), "mass_tolerance") == 0) {
@@ -100,6 +124,52 @@ Configuration::Configuration(const char *filename)
                 this->target_masses.push_back(value_double);
             } while (*value && *value != '\n');
         }
+        else if (strcmpi(key.c_str(), "target_intensities") == 0) {
+            // Whitespace-separated list of doubles, one per target mass
+            char *endptr;
+            double value_double;
+            do {
+                value_double = strtod(value, &endptr);
+                if (endptr == value) {
+                    fprintf(stderr, "Invalid double value for target intensity list: '%s'\n", value);
+                    break;
+                }
+                value = endptr;
+                this->target_intensities.push_back(value_double);
+            } while (*value && *value != '\n');
+        }
+        else if (strcmpi(key.c_str(), "partial_scoring") == 0) {
+            bool value_bool;
+            if (strncmpi(value, "true", sizeof("true") - 1) == 0) {
+                value_bool = true;
+            } else if (strncmpi(value, "false", sizeof("false") - 1) == 0) {
+                value_bool = false;
+            }
+            else {
+                fprintf(stderr, "Invalid bool value for partial_scoring: '%s'\n", value);
+                continue;
+            }
+            this->partial_scoring = value_bool;
+        }
+        else if (strcmpi(key.c_str(), "top_k") == 0) {
+            // Every search thread keeps a heap of up to top_k peptides
+            char *endptr;
+            long value_int = strtol(value, &endptr, 0);
+            if (endptr == value || value_int < 1 || value_int > 1000000) {
+                fprintf(stderr, "Invalid int value for top_k: '%s'\n", value);
+                continue;
+            }
+            this->top_k = (int)value_int;
+        }
+        else if (strcmpi(key.c_str(), "min_matched_targets") == 0) {
+            char *endptr;
+            int value_int = strtol(value, &endptr, 0);
+            if (endptr == value || value_int < 1) {
+                fprintf(stderr, "Invalid int value for min_matched_targets: '%s'\n", value);
+                continue;
+            }
+            this->min_matched_targets = value_int;
+        }
         else if (strcmpi(key.c_str(), "num_search_threads") == 0) {
             char *endptr;
             int value_int = strtol(value, &endptr, 0);
@@ -109,6 +179,64 @@ Configuration::Configuration(const char *filename)
             }
             this->num_search_threads = value_int;
         }
+        else if (strcmpi(key.c_str(), "precursor_mass") == 0) {
+            char *endptr;
+            double value_double = strtod(value, &endptr);
+            if (endptr == value || value_double < 0) {
+                fprintf(stderr, "Invalid double value for precursor_mass: '%s'\n", value);
+                continue;
+            }
+            this->precursor_mass = value_double;
+        }
+        else if (strcmpi(key.c_str(), "precursor_tolerance") == 0) {
+            char *endptr;
+            double value_double = strtod(value, &endptr);
+            if (endptr == value || value_double < 0) {
+                fprintf(stderr, "Invalid double value for precursor_tolerance: '%s'\n", value);
+                continue;
+            }
+            this->precursor_tolerance = value_double;
+        }
+        else if (strcmpi(key.c_str(), "peptide_table") == 0) {
+            bool value_bool;
+            if (strncmpi(value, "true", sizeof("true") - 1) == 0) {
+                value_bool = true;
+            } else if (strncmpi(value, "false", sizeof("false") - 1) == 0) {
+                value_bool = false;
+            }
+            else {
+                fprintf(stderr, "Invalid bool value for peptide_table: '%s'\n", value);
+                continue;
+            }
+            this->peptide_table = value_bool;
+        }
+        else if (strcmpi(key.c_str(), "time_budget_seconds") == 0) {
+            char *endptr;
+            double value_double = strtod(value, &endptr);
+            if (endptr == value || value_double < 0) {
+                fprintf(stderr, "Invalid double value for time_budget_seconds: '%s'\n", value);
+                continue;
+            }
+            this->time_budget_seconds = value_double;
+        }
+        else if (strcmpi(key.c_str(), "residue_budget") == 0) {
+            char *endptr;
+            double value_double = strtod(value, &endptr);
+            if (endptr == value || value_double < 0) {
+                fprintf(stderr, "Invalid double value for residue_budget: '%s'\n", value);
+                continue;
+            }
+            this->residue_budget = value_double;
+        }
+        else if (strcmpi(key.c_str(), "progress_interval_seconds") == 0) {
+            char *endptr;
+            double value_double = strtod(value, &endptr);
+            if (endptr == value || value_double < 0) {
+                fprintf(stderr, "Invalid double value for progress_interval_seconds: '%s'\n", value);
+                continue;
+            }
+            this->progress_interval_seconds = value_double;
+        }
         else if (strcmpi(key.c_str(), "read_database_multithreaded") == 0) {
             bool value_bool;
             if (strncmpi(value, "true", sizeof("true") - 1) == 0) {
@@ -123,6 +251,105 @@ Configuration::Configuration(const char *filename)
             }
             this->read_database_multithreaded = value_bool;
         }
+        else if (strcmpi(key.c_str(), "numa_placement") == 0) {
+            bool value_bool;
+            if (strncmpi(value, "true", sizeof("true") - 1) == 0) {
+                value_bool = true;
+            } else if (strncmpi(value, "false", sizeof("false") - 1) == 0) {
+                value_bool = false;
+            }
+            else {
+                fprintf(stderr, "Invalid bool value for numa_placement: '%s'\n", value);
+                continue;
+            }
+            this->numa_placement = value_bool;
+        }
+        else if (strcmpi(key.c_str(), "thread_affinity") == 0) {
+            if (strncmpi(value, "none", sizeof("none") - 1) == 0) {
+                this->thread_affinity = ThreadAffinity::None;
+            } else if (strncmpi(value, "cores", sizeof("cores") - 1) == 0) {
+                this->thread_affinity = ThreadAffinity::Cores;
+            } else if (strncmpi(value, "numa", sizeof("numa") - 1) == 0) {
+                this->thread_affinity = ThreadAffinity::Numa;
+            }
+            else {
+                fprintf(stderr, "Invalid value for thread_affinity (none, cores or numa): '%s'\n", value);
+                continue;
+            }
+        }
+        else if (strcmpi(key.c_str(), "decoy_mode") == 0) {
+            if (strncmpi(value, "none", sizeof("none") - 1) == 0) {
+                this->decoy_mode = DecoyMode::None;
+            } else if (strncmpi(value, "reverse", sizeof("reverse") - 1) == 0) {
+                this->decoy_mode = DecoyMode::Reverse;
+            } else if (strncmpi(value, "shuffle", sizeof("shuffle") - 1) == 0) {
+                this->decoy_mode = DecoyMode::Shuffle;
+            }
+            else {
+                fprintf(stderr, "Invalid value for decoy_mode (none, reverse or shuffle): '%s'\n", value);
+                continue;
+            }
+        }
+        else if (strcmpi(key.c_str(), "mass_prefilter") == 0) {
+            bool value_bool;
+            if (strncmpi(value, "true", sizeof("true") - 1) == 0) {
+                value_bool = true;
+            } else if (strncmpi(value, "false", sizeof("false") - 1) == 0) {
+                value_bool = false;
+            }
+            else {
+                fprintf(stderr, "Invalid bool value for mass_prefilter: '%s'\n", value);
+                continue;
+            }
+            this->mass_prefilter = value_bool;
+        }
+        else if (strcmpi(key.c_str(), "prefilter_bin_width") == 0) {
+            char *endptr;
+            double value_double = strtod(value, &endptr);
+            if (endptr == value || value_double <= 0) {
+                fprintf(stderr, "Invalid double value for prefilter_bin_width: '%s'\n", value);
+                continue;
+            }
+            this->prefilter_bin_width = value_double;
+        }
+        else if (strcmpi(key.c_str(), "result_cache_directory") == 0) {
+            std::string value_str;
+            if (!parse_path_value(value, value_str)) {
+                fprintf(stderr, "Invalid result_cache_directory value: '%s'\n", value);
+                continue;
+            }
+            this->result_cache_directory = value_str;
+        }
+        else if (strcmpi(key.c_str(), "result_cache_max_mb") == 0) {
+            char *endptr;
+            double value_double = strtod(value, &endptr);
+            if (endptr == value || value_double < 0) {
+                fprintf(stderr, "Invalid double value for result_cache_max_mb: '%s'\n", value);
+                continue;
+            }
+            this->result_cache_max_mb = value_double;
+        }
+        else if (strcmpi(key.c_str(), "database_index") == 0) {
+            bool value_bool;
+            if (strncmpi(value, "true", sizeof("true") - 1) == 0) {
+                value_bool = true;
+            } else if (strncmpi(value, "false", sizeof("false") - 1) == 0) {
+                value_bool = false;
+            }
+            else {
+                fprintf(stderr, "Invalid bool value for database_index: '%s'\n", value);
+                continue;
+            }
+            this->database_index = value_bool;
+        }
+        else if (strcmpi(key.c_str(), "index_directory") == 0) {
+            std::string value_str;
+            if (!parse_path_value(value, value_str)) {
+                fprintf(stderr, "Invalid index_directory value: '%s'\n", value);
+                continue;
+            }
+            this->index_directory = value_str;
+        }
         else if (strcmpi(key.c_str(), "gluc_digest") == 0) {
             bool value_bool;
             if (strncmpi(value, "true", sizeof("true") - 1) == 0) {
@@ -4,6 +4,22 @@
 #include <vector>
 #include <string>
 
+// How search worker threads are pinned to CPUs
+enum class ThreadAffinity
+{
+    None,   // Not pinned
+    Cores,  // Each worker pinned to one CPU, filling one NUMA node before the next
+    Numa,   // Each worker pinned to all CPUs of one NUMA node, round-robin over the nodes
+};
+
+// Decoy peptides searched alongside the targets to estimate the false discovery rate
+enum class DecoyMode
+{
+    None,       // Targets only
+    Reverse,    // Each digest reversed, keeping its C-terminal residue
+    Shuffle,    // Each digest shuffled (deterministically), keeping its C-terminal residue
+};
+
 class Configuration
 {
     // Configuration variables
@@ -13,15 +29,58 @@ public:
     double mass_tolerance;
     bool gluc_digest;
 
+    // Precursor window: only search peptides whose intact mass (residues + water) is within
+    // precursor_tolerance of precursor_mass (0 = no window). Looked up in a mass-sorted peptide table,
+    // which is built at load time when a precursor mass is set or peptide_table is true.
+    double precursor_mass;
+    double precursor_tolerance;
+    bool peptide_table;
+
+    // Partial-match scoring: rank peptides by how many targets they match (weighted by
+    // target_intensities if given) and keep the top_k best (up to 1000000) instead of requiring every target
+    bool partial_scoring;
+    int top_k;
+    int min_matched_targets;
+    std::vector<double> target_intensities;
+
+    // Search a virtual decoy of every digest too (generated while fragmenting, nothing is stored)
+    DecoyMode decoy_mode;
+
     int num_search_threads;
     bool read_database_multithreaded;
 
+    // Budgets for long searches (0 = unlimited): once either is used up the workers stop early and
+    // the matches found so far are written out. The work budget counts residues searched.
+    double time_budget_seconds;
+    double residue_budget;
+
+    // How often to report search progress on stderr (0 = never)
+    double progress_interval_seconds;
+
+    // NUMA: shard each database's sequences across the nodes (placed by first touch from a thread
+    // pinned to each node), and pin the search workers. numa_placement implies at least Numa affinity.
+    bool numa_placement;
+    ThreadAffinity thread_affinity;
+
+    // Mass-bin prefilter: reject peptides by signature before the exact fragment check
+    // (only used when mass_tolerance <= prefilter_bin_width / 2)
+    bool mass_prefilter;
+    double prefilter_bin_width;
+
+    // On-disk result cache (disabled when the directory is empty)
+    std::string result_cache_directory;
+    double result_cache_max_mb;
+
+    // Incremental database index: parsed blocks are kept in an .fsidx file and reused across releases
+    // (stored next to each database file unless index_directory is set)
+    bool database_index;
+    std::string index_directory;
+
 public:
     // Constructor: from file
     Configuration(const char *filename);
 
-private:
-    // Constructor: default configuration
+    // Constructor: default configuration (fill in the fields in code)
     Configuration();
 };
 
@@ -5,45 +5,44 @@
 #include <stdexcept>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
 
 #include <sys/stat.h>
 
-struct result_struct {
-    std::vector<Protein> load_results;
-};
-
-struct thread_args_struct {
-    thread_args_struct(result_struct &results, const std::string &source_path, const char *file_buffer, size_t file_size, size_t start_position, size_t n_bytes) : 
-        results(results), source_path(source_path), file_buffer(file_buffer), file_size(file_size), start_position(start_position), n_bytes(n_bytes)  { }
+#include "Hash.h"
+#include "Numa.h"
+#include "SearchEngine.h"
 
-    result_struct &results;
-    const std::string &source_path;
-    const char *file_buffer;
-    size_t file_size;
-    size_t start_position;
-    size_t n_bytes;
-};
+#ifdef _MSC_VER
+#include <process.h>
+#define fseek64(fp, offset, origin) _fseeki64(fp, offset, origin)
+#define getpid() _getpid()
+#else
+#include <unistd.h>
+#define fseek64(fp, offset, origin) fseeko(fp, offset, origin)
+#endif
 
-void LoadThreadProc(thread_args_struct args)
+// Parse every record in file_buffer[begin, end) and append it to sequences
+static void parse_fasta(const char *file_buffer, size_t begin, size_t end, uint16_t database_id, std::vector<Protein> &sequences)
 {
-    const std::string &source_path = args.source_path;
-    const char *file_buffer = args.file_buffer;
-    size_t file_size = args.file_size;
-    size_t start_position = args.start_position;
-    size_t n_bytes = args.n_bytes;
-
-    std::vector<Protein> results;
-    size_t estimated_result_count = (n_bytes / 500);
-    results.reserve(estimated_result_count);
-
     // Allocate a container for the sequences
     Protein protein;
-    std::string description;
+    protein.database_id = database_id;
     bool in_description = false;
-    bool found_sequence = false;
 
     // Run through the file and process protein sequences
-    for (uint64_t i = start_position; i < file_size; i++) {
+    for (size_t i = begin; i < end; i++) {
 
         // We shouldn't have any NULs, but just in case...
         if (file_buffer[i] == '\0') continue;
@@ -52,29 +51,24 @@ void LoadThreadProc(thread_args_struct args)
         if (!in_description && file_buffer[i] == '>') {
             // Process the existing sequence
             if (!protein.sequence.empty()) {
-                protein.description = std::move(description);
-                results.push_back(std::move(protein));
+                protein.build_index();
+                sequences.push_back(std::move(protein));
             }
-            // Check if we're at the end of what we should be processing
-            if (i >= start_position + n_bytes) break;
-
             in_description = true;
-            found_sequence = true;
-            protein.source_database = source_path;
+            protein.database_id = database_id;
+            protein.description_offset = i + 1;
+            protein.description_length = 0;
+            protein.accession.clear();
             protein.sequence.clear();
-            description.clear();
-            // Average sequence length is 360 (but max is around 30k). Reserve a healthy amount of sequence memory
-            protein.sequence.reserve(360 * 2);
-        } else if (!found_sequence) {
-            // We're at the end of the prior thread's sequence, nothing to do here
         } else {
             // In an existing sequence. Check if we're still populating the description
             if (in_description) {
-                // Check if we've reached the end yet, signified by a newline character
+                // Check if we've reached the end yet, signified by a newline character.
+                // Only the header's position is kept; the text stays in the file.
                 if (file_buffer[i] == '\r' || file_buffer[i] == '\n') {
                     in_description = false;
-                } else {
-                    description += file_buffer[i];
+                    protein.description_length = (uint32_t)(i - protein.description_offset);
+                    protein.accession = parse_accession(file_buffer + protein.description_offset, protein.description_length);
                 }
             } else {
                 // Otherwise we're adding to the sequence.
@@ -84,44 +78,601 @@ void LoadThreadProc(thread_args_struct args)
         }
     }
 
-
     // Process the last sequence
     if (!protein.sequence.empty()) {
-        protein.description = std::move(description);
-        results.push_back(protein);
+        protein.build_index();
+        sequences.push_back(std::move(protein));
     }
-    args.results.load_results = std::move(results);
 }
 
-Database::Database(std::string path)
+// Build the mass prefilter signatures of sequences (none if bin_width is 0)
+static void build_block_signatures(std::vector<Protein> &sequences, double bin_width, bool gluc_digest)
 {
-    this->source_path = path;
+    if (bin_width <= 0) return;
+    for (auto &protein : sequences) {
+        protein.build_signatures(bin_width, gluc_digest);
+    }
+}
+
+// The reader thread hands the file over to the parser in chunks of this size
+static const size_t read_chunk_bytes = 4 * 1024 * 1024;
+
+// Reads a whole file into memory on a background thread, so parsing can start on the first chunks
+// while the rest is still being read
+class file_reader
+{
+public:
+    long long read_millis;
+    time_t modified_time;
 
-    FILE *database_fp = fopen(path.c_str(), "rb");
-    if (!database_fp) {
-        int err = errno;
-        std::stringstream message;
-        message << "Unable to open " << path << " for reading: errno " << err << ".\n";
-        throw std::invalid_argument(message.str());
+public:
+    file_reader(const std::string &path) : path(path)
+    {
+        this->read_millis = 0;
+        this->available = 0;
+        this->failed = false;
+        this->stopped = false;
+        this->error = 0;
+
+        this->fp = fopen(path.c_str(), "rb");
+        if (!this->fp) {
+            int err = errno;
+            std::stringstream message;
+            message << "Unable to open " << path << " for reading: errno " << err << ".\n";
+            throw std::invalid_argument(message.str());
+        }
+        struct stat file_stat;
+        stat(path.c_str(), &file_stat);
+        this->file_size = file_stat.st_size;
+        this->modified_time = file_stat.st_mtime;
+        this->buffer.reset(new char[this->file_size > 0 ? this->file_size : 1]);
+        this->thread = std::thread(&file_reader::read_proc, this);
     }
 
-    // Read the whole file into ram
-    struct stat file_stat;
-    stat(path.c_str(), &file_stat);
-    uint64_t file_size = file_stat.st_size;
-    char *file_buffer = new char[file_size];
-
-    auto start_read = std::chrono::high_resolution_clock::now();
-    if (file_size != fread(file_buffer, 1, file_size, database_fp)) {
-        int err = errno;
-        fclose(database_fp);
-        std::stringstream message;
-        message << "Unable to read " << file_size << " bytes from " << path << ": errno " << err << ".\n";
-        delete[] file_buffer;
-        throw std::invalid_argument(message.str());
-    }
-    auto finish_read = std::chrono::high_resolution_clock::now();
-    fclose(database_fp);
+    ~file_reader()
+    {
+        if (this->thread.joinable()) this->thread.join();
+        fclose(this->fp);
+    }
+
+    const char *data() const { return this->buffer.get(); }
+    size_t size() const { return this->file_size; }
+
+    // Block until more than `seen` bytes have been read (or the whole file); returns the number available
+    size_t wait_for_more(size_t seen)
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->data_ready.wait(lock, [&]() { return this->failed || this->available > seen || this->available == this->file_size; });
+        if (this->failed) {
+            std::stringstream message;
+            message << "Unable to read " << this->file_size << " bytes from " << this->path << ": errno " << this->error << ".\n";
+            throw std::invalid_argument(message.str());
+        }
+        return this->available;
+    }
+
+    void join()
+    {
+        if (this->thread.joinable()) this->thread.join();
+    }
+
+    // Give up on the rest of the file
+    void stop()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopped = true;
+    }
+
+private:
+    std::string path;
+    FILE *fp;
+    size_t file_size;
+    std::unique_ptr<char[]> buffer;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable data_ready;
+    size_t available;
+    bool failed;
+    bool stopped;
+    int error;
+
+    void read_proc()
+    {
+        auto start_read = std::chrono::high_resolution_clock::now();
+        size_t position = 0;
+        while (position < this->file_size) {
+            size_t n_bytes = std::min(read_chunk_bytes, this->file_size - position);
+            size_t n_read = fread(this->buffer.get() + position, 1, n_bytes, this->fp);
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (this->stopped) break;
+            if (n_read != n_bytes) {
+                this->failed = true;
+                this->error = errno;
+                break;
+            }
+            position += n_read;
+            this->available = position;
+            this->data_ready.notify_all();
+        }
+        auto finish_read = std::chrono::high_resolution_clock::now();
+        this->read_millis = std::chrono::duration_cast<std::chrono::milliseconds>(finish_read - start_read).count();
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->data_ready.notify_all();
+    }
+};
+
+ParseQueue::ParseQueue(int n_threads)
+{
+    if (n_threads <= 0) n_threads = std::thread::hardware_concurrency();
+    if (n_threads <= 0) n_threads = 1;
+    this->stopping = false;
+    for (int i = 0; i < n_threads; i++) {
+        this->threads.push_back(std::thread(&ParseQueue::worker_loop, this));
+    }
+}
+
+ParseQueue::~ParseQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->task_ready.notify_all();
+    for (auto &t : this->threads) {
+        t.join();
+    }
+}
+
+void ParseQueue::worker_loop()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for (;;) {
+        this->task_ready.wait(lock, [this]() { return this->stopping || !this->tasks.empty(); });
+        if (this->tasks.empty()) return;
+        Group *group = this->tasks.front().first;
+        std::function<void()> task = std::move(this->tasks.front().second);
+        this->tasks.pop_front();
+        lock.unlock();
+
+        task();
+
+        lock.lock();
+        if (--group->n_pending == 0) this->task_done.notify_all();
+    }
+}
+
+ParseQueue::Group::Group(ParseQueue &queue) : queue(queue)
+{
+    this->n_pending = 0;
+}
+
+// The tasks refer to the load's buffers, so they must be done before those go away (even on an exception)
+ParseQueue::Group::~Group()
+{
+    this->wait();
+}
+
+void ParseQueue::Group::push(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->queue.mutex);
+        ++this->n_pending;
+        this->queue.tasks.push_back(std::make_pair(this, std::move(task)));
+    }
+    this->queue.task_ready.notify_one();
+}
+
+void ParseQueue::Group::wait()
+{
+    std::unique_lock<std::mutex> lock(this->queue.mutex);
+    this->queue.task_done.wait(lock, [this]() { return this->n_pending == 0; });
+}
+
+// Start of the first record (a '>' at the beginning of a line) at or after position, or end if there is none
+static size_t next_record_start(const char *file_buffer, size_t position, size_t end)
+{
+    if (position >= end) return end;
+    if (file_buffer[position] == '>' && (position == 0 || file_buffer[position - 1] == '\n')) return position;
+    while (position < end) {
+        const char *newline = (const char *)memchr(file_buffer + position, '\n', end - position);
+        if (!newline) return end;
+        position = newline - file_buffer + 1;
+        if (position < end && file_buffer[position] == '>') return position;
+    }
+    return end;
+}
+
+// Start of the last record that begins after position, or position if no record starts in (position, end)
+static size_t last_record_start(const char *file_buffer, size_t position, size_t end)
+{
+    for (size_t i = end; i > position + 1; i--) {
+        if (file_buffer[i - 1] == '>' && file_buffer[i - 2] == '\n') return i - 1;
+    }
+    return position;
+}
+
+// Incremental index
+//
+// The database text is split into blocks of whole records. A block ends after any record whose hash has its
+// low bits set, so block boundaries depend only on nearby content: inserting, removing or editing a record
+// changes the block it is in, and every other block keeps its hash. Each block's parsed proteins (sequence,
+// digest boundaries and unknown residues) are stored in the index file under that hash, so a later load only
+// needs to parse the blocks that are new. The prefilter signatures are stored too; the header records the bin
+// width and digest mode they were built for, and a load configured differently rebuilds them.
+
+static const char index_magic[8] = { 'F', 'S', 'I', 'D', 'X', '0', '0', '4' };
+static const uint64_t block_boundary_mask = 0x7f;       // ~128 records per block
+static const size_t max_block_bytes = 4 * 1024 * 1024;
+
+// Without the index, the text is handed to the parse workers in segments of about this size
+static const size_t segment_bytes = 1024 * 1024;
+
+struct record_block {
+    uint64_t hash;
+    size_t begin;
+    size_t end;
+    bool reused;
+    std::vector<Protein> proteins;
+};
+
+struct index_directory_entry {
+    uint64_t hash;
+    uint64_t text_bytes;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// Splits the text into blocks as it arrives. Each call covers whole records; the last, still open block
+// carries over to the next call.
+class block_splitter
+{
+public:
+    block_splitter()
+    {
+        this->block_begin = 0;
+        this->block_hash = fnv_offset_basis;
+    }
+
+    void add(const char *file_buffer, size_t begin, size_t end, bool at_end_of_file, std::deque<record_block> &blocks)
+    {
+        size_t record_begin = begin;
+        while (record_begin < end) {
+            size_t record_end = next_record_start(file_buffer, record_begin + 1, end);
+
+            uint64_t record_hash = fnv1a(file_buffer + record_begin, record_end - record_begin);
+            this->block_hash = fnv1a(&record_hash, sizeof(record_hash), this->block_hash);
+            record_begin = record_end;
+
+            if ((record_hash & block_boundary_mask) == block_boundary_mask || record_end - this->block_begin >= max_block_bytes || (at_end_of_file && record_end == end)) {
+                record_block block;
+                block.hash = this->block_hash;
+                block.begin = this->block_begin;
+                block.end = record_end;
+                block.reused = false;
+                blocks.push_back(std::move(block));
+                this->block_begin = record_end;
+                this->block_hash = fnv_offset_basis;
+            }
+        }
+    }
+
+private:
+    size_t block_begin;
+    uint64_t block_hash;
+};
+
+static std::string index_file_path(const std::string &database_path, const Configuration &config)
+{
+    if (config.index_directory.empty()) return database_path + ".fsidx";
+    size_t separator = database_path.find_last_of("/\\");
+    std::string file_name = separator == std::string::npos ? database_path : database_path.substr(separator + 1);
+
+    // Databases with the same file name in different directories share the index directory,
+    // so tell them apart by a hash of the full path
+    std::string full_path = database_path;
+#ifdef _MSC_VER
+    char resolved[_MAX_PATH];
+    if (_fullpath(resolved, database_path.c_str(), sizeof(resolved))) full_path = resolved;
+#else
+    char *resolved = realpath(database_path.c_str(), nullptr);
+    if (resolved) {
+        full_path = resolved;
+        free(resolved);
+    }
+#endif
+    char hash[17];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)fnv1a(full_path.data(), full_path.size()));
+    return config.index_directory + "/" + file_name + "." + hash + ".fsidx";
+}
+
+template <typename T>
+static void write_value(std::vector<char> &buffer, const T &value)
+{
+    const char *bytes = (const char *)&value;
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T));
+}
+
+template <typename T>
+static void write_array(std::vector<char> &buffer, const T *values, uint32_t count)
+{
+    write_value(buffer, count);
+    const char *bytes = (const char *)values;
+    buffer.insert(buffer.end(), bytes, bytes + sizeof(T) * count);
+}
+
+template <typename T>
+static bool read_value(const std::vector<char> &buffer, size_t &position, T &value)
+{
+    if (position + sizeof(T) > buffer.size()) return false;
+    memcpy(&value, buffer.data() + position, sizeof(T));
+    position += sizeof(T);
+    return true;
+}
+
+template <typename C>
+static bool read_array(const std::vector<char> &buffer, size_t &position, C &values)
+{
+    uint32_t count;
+    if (!read_value(buffer, position, count)) return false;
+    size_t n_bytes = sizeof(typename C::value_type) * count;
+    if (position + n_bytes > buffer.size()) return false;
+    values.resize(count);
+    if (n_bytes) memcpy(&values[0], buffer.data() + position, n_bytes);
+    position += n_bytes;
+    return true;
+}
+
+static void serialize_block(const record_block &block, std::vector<char> &buffer)
+{
+    buffer.clear();
+    write_value(buffer, (uint32_t)block.proteins.size());
+    for (const auto &protein : block.proteins) {
+        // Header offsets are kept relative to the block, which may sit elsewhere in the next release of the file
+        write_value(buffer, (uint64_t)(protein.description_offset - block.begin));
+        write_value(buffer, protein.description_length);
+        write_array(buffer, protein.accession.data(), (uint32_t)protein.accession.size());
+        write_array(buffer, protein.sequence.data(), (uint32_t)protein.sequence.size());
+        write_array(buffer, protein.digest_ends.data(), (uint32_t)protein.digest_ends.size());
+        write_array(buffer, protein.unknown_residues.data(), (uint32_t)protein.unknown_residues.size());
+        write_array(buffer, protein.signatures.data(), (uint32_t)protein.signatures.size());
+    }
+}
+
+static bool deserialize_block(const std::vector<char> &buffer, uint16_t database_id, bool keep_signatures, record_block &block)
+{
+    size_t position = 0;
+    uint32_t n_proteins;
+    if (!read_value(buffer, position, n_proteins)) return false;
+    // Each protein takes at least its header offset and length and the five array counts
+    size_t min_protein_bytes = sizeof(uint64_t) + sizeof(uint32_t) + 5 * sizeof(uint32_t);
+    if (n_proteins > (buffer.size() - position) / min_protein_bytes) return false;
+    block.proteins.resize(n_proteins);
+    for (auto &protein : block.proteins) {
+        protein.database_id = database_id;
+        uint64_t relative_offset;
+        bool ok = read_value(buffer, position, relative_offset) &&
+            read_value(buffer, position, protein.description_length) &&
+            read_array(buffer, position, protein.accession) &&
+            read_array(buffer, position, protein.sequence) &&
+            read_array(buffer, position, protein.digest_ends) &&
+            read_array(buffer, position, protein.unknown_residues) &&
+            read_array(buffer, position, protein.signatures);
+        if (!ok) return false;
+        if (!keep_signatures) std::vector<MassSignature>().swap(protein.signatures);
+        protein.description_offset = block.begin + relative_offset;
+    }
+    return position == buffer.size();
+}
+
+// Key for looking up a block in the previous index: content hash, salted with the length of its text
+static uint64_t block_key(uint64_t hash, uint64_t text_bytes)
+{
+    return fnv1a(&text_bytes, sizeof(text_bytes), hash);
+}
+
+// The index written by the previous load, for picking up blocks that haven't changed since
+class previous_index
+{
+public:
+    previous_index(const std::string &index_path)
+    {
+        this->signature_bin_width = 0;
+        this->signature_gluc = false;
+        this->fp = fopen(index_path.c_str(), "rb");
+        if (!this->fp) return;
+
+        char magic[sizeof(index_magic)];
+        uint64_t n_entries = 0, directory_offset = 0, signature_gluc = 0;
+        struct stat file_stat;
+        bool valid = stat(index_path.c_str(), &file_stat) == 0 &&
+            fread(magic, 1, sizeof(magic), this->fp) == sizeof(magic) && memcmp(magic, index_magic, sizeof(magic)) == 0 &&
+            fread(&n_entries, sizeof(n_entries), 1, this->fp) == 1 && fread(&directory_offset, sizeof(directory_offset), 1, this->fp) == 1 &&
+            fread(&this->signature_bin_width, sizeof(this->signature_bin_width), 1, this->fp) == 1 && fread(&signature_gluc, sizeof(signature_gluc), 1, this->fp) == 1;
+        this->signature_gluc = signature_gluc != 0;
+
+        // The sizes come from the file, so check them against it before allocating anything:
+        // the directory fills the end of the file, and every block lies between the header and the directory
+        uint64_t file_size = valid ? (uint64_t)file_stat.st_size : 0;
+        uint64_t header_size = sizeof(index_magic) + sizeof(n_entries) + sizeof(directory_offset) + sizeof(this->signature_bin_width) + sizeof(signature_gluc);
+        valid = valid && directory_offset >= header_size && directory_offset <= file_size &&
+            n_entries == (file_size - directory_offset) / sizeof(index_directory_entry) &&
+            (file_size - directory_offset) % sizeof(index_directory_entry) == 0;
+        if (valid) {
+            this->directory.resize((size_t)n_entries);
+            valid = fseek64(this->fp, directory_offset, SEEK_SET) == 0 && (n_entries == 0 || fread(this->directory.data(), sizeof(index_directory_entry), this->directory.size(), this->fp) == this->directory.size());
+        }
+        for (size_t i = 0; valid && i < this->directory.size(); i++) {
+            const index_directory_entry &entry = this->directory[i];
+            valid = entry.offset >= header_size && entry.offset <= directory_offset && entry.length <= directory_offset - entry.offset;
+        }
+        if (!valid) {
+            fprintf(stderr, "Ignoring unreadable index file '%s'.\n", index_path.c_str());
+            this->directory.clear();
+            this->signature_bin_width = 0;
+            return;
+        }
+        for (const auto &entry : this->directory) {
+            this->entries[block_key(entry.hash, entry.text_bytes)] = &entry;
+        }
+    }
+
+    ~previous_index()
+    {
+        if (this->fp) fclose(this->fp);
+    }
+
+    // True if the stored signatures were built with this bin width and digest mode
+    bool signatures_match(double bin_width, bool gluc_digest) const
+    {
+        return bin_width > 0 && this->signature_bin_width == bin_width && this->signature_gluc == gluc_digest;
+    }
+
+    // Fill in the block's proteins from the previous index if it's unchanged; returns false if it needs parsing.
+    // The stored signatures are dropped unless keep_signatures is set.
+    bool load(uint16_t database_id, bool keep_signatures, record_block &block)
+    {
+        auto it = this->entries.find(block_key(block.hash, block.end - block.begin));
+        if (it == this->entries.end()) return false;
+        const index_directory_entry &entry = *it->second;
+        this->buffer.resize((size_t)entry.length);
+        if (fseek64(this->fp, entry.offset, SEEK_SET) != 0 || fread(this->buffer.data(), 1, this->buffer.size(), this->fp) != this->buffer.size()) return false;
+        block.reused = deserialize_block(this->buffer, database_id, keep_signatures, block);
+        if (!block.reused) block.proteins.clear();
+        return block.reused;
+    }
+
+private:
+    FILE *fp;
+    double signature_bin_width;
+    bool signature_gluc;
+    std::vector<index_directory_entry> directory;
+    std::unordered_map<uint64_t, const index_directory_entry *> entries;
+    std::vector<char> buffer;
+};
+
+// The blocks' proteins must all carry signatures built with signature_bin_width and signature_gluc (or none, with width 0)
+static void write_index(const std::string &index_path, const std::deque<record_block> &blocks, double signature_bin_width, bool signature_gluc)
+{
+    // Unique per writer: the same database may be loaded by several threads or processes at once
+    std::stringstream temp_name;
+    temp_name << index_path << "." << getpid() << "." << std::hash<std::thread::id>()(std::this_thread::get_id()) << ".tmp";
+    std::string temp_path = temp_name.str();
+    FILE *index_fp = fopen(temp_path.c_str(), "wb");
+    if (!index_fp) {
+        fprintf(stderr, "Unable to write index file '%s'.\n", index_path.c_str());
+        return;
+    }
+
+    uint64_t n_entries = blocks.size();
+    uint64_t directory_offset = 0;
+    uint64_t signature_mode = signature_gluc ? 1 : 0;
+    fwrite(index_magic, 1, sizeof(index_magic), index_fp);
+    fwrite(&n_entries, sizeof(n_entries), 1, index_fp);
+    fwrite(&directory_offset, sizeof(directory_offset), 1, index_fp);
+    fwrite(&signature_bin_width, sizeof(signature_bin_width), 1, index_fp);
+    fwrite(&signature_mode, sizeof(signature_mode), 1, index_fp);
+
+    std::vector<index_directory_entry> directory;
+    directory.reserve(blocks.size());
+    uint64_t offset = sizeof(index_magic) + sizeof(n_entries) + sizeof(directory_offset) + sizeof(signature_bin_width) + sizeof(signature_mode);
+    std::vector<char> buffer;
+    for (const auto &block : blocks) {
+        serialize_block(block, buffer);
+        fwrite(buffer.data(), 1, buffer.size(), index_fp);
+        index_directory_entry entry;
+        entry.hash = block.hash;
+        entry.text_bytes = block.end - block.begin;
+        entry.offset = offset;
+        entry.length = buffer.size();
+        directory.push_back(entry);
+        offset += buffer.size();
+    }
+
+    // The directory goes at the end; go back and fill in its offset in the header
+    directory_offset = offset;
+    if (!directory.empty()) fwrite(directory.data(), sizeof(index_directory_entry), directory.size(), index_fp);
+    fseek64(index_fp, sizeof(index_magic) + sizeof(n_entries), SEEK_SET);
+    fwrite(&directory_offset, sizeof(directory_offset), 1, index_fp);
+    bool ok = !ferror(index_fp);
+    fclose(index_fp);
+
+    if (!ok) {
+        fprintf(stderr, "Unable to write index file '%s'.\n", index_path.c_str());
+        remove(temp_path.c_str());
+        return;
+    }
+    remove(index_path.c_str());
+    rename(temp_path.c_str(), index_path.c_str());
+}
+
+// Split the sequences into one shard per NUMA node (balanced by residue count), then have a thread
+// pinned to each node re-allocate its shard's buffers so that first touch puts them in that node's memory.
+// With a single node this still runs (one shard), it just has nothing to gain.
+void Database::place_on_numa_nodes()
+{
+    const NumaTopology &topology = NumaTopology::Get();
+    int n_nodes = topology.node_count();
+
+    size_t total_residues = 0;
+    for (const auto &protein : this->sequences) {
+        total_residues += protein.sequence.size();
+    }
+
+    this->shards.clear();
+    size_t residues_seen = 0;
+    int begin = 0;
+    for (int node = 0; node < n_nodes; node++) {
+        size_t shard_target = total_residues * (node + 1) / n_nodes;
+        int end = begin;
+        while (end < (int)this->sequences.size() && (residues_seen < shard_target || node + 1 == n_nodes)) {
+            residues_seen += this->sequences[end].sequence.size();
+            ++end;
+        }
+        DatabaseShard shard;
+        shard.begin = begin;
+        shard.end = end;
+        shard.node = node;
+        this->shards.push_back(shard);
+        begin = end;
+    }
+
+    // Without pinning, first touch lands wherever the thread happens to run
+    std::atomic<bool> pinned(true);
+    std::vector<std::thread> threads;
+    for (const auto &shard : this->shards) {
+        threads.push_back(std::thread([this, &topology, &pinned, shard]() {
+            if (!pin_current_thread(topology.node_cpus[shard.node])) pinned = false;
+            for (int i = shard.begin; i < shard.end; i++) {
+                // Copying allocates (and touches) fresh buffers from this thread
+                Protein local = this->sequences[i];
+                this->sequences[i] = std::move(local);
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    if (!pinned) {
+        warn_pinning_failed();
+        return;
+    }
+    fprintf(stderr, "Placed %zd sequences on %d NUMA node(s).\n", this->sequences.size(), n_nodes);
+}
+
+Database::Database(std::string path, const Configuration &config, ParseQueue *workers, const CancellationToken *cancellation)
+{
+    this->n_blocks_reused = 0;
+    this->n_blocks_rebuilt = 0;
+    this->signature_bin_width = 0;
+    this->signature_gluc = config.gluc_digest;
+    this->peptide_table_gluc = config.gluc_digest;
+    this->source_path = path;
+
+    // Start reading the whole file into ram in the background
+    file_reader reader(path);
+    const char *file_buffer = reader.data();
+    size_t file_size = reader.size();
+    this->database_id = intern_database_path(path, file_size, reader.modified_time);
 
     // Pre-allocate space for our sequences
     // The SwissProt database has about 1 sequence / 500 bytes. Use that as a ballpark estimate
@@ -129,85 +680,273 @@ Database::Database(std::string path)
     size_t n_estimated_sequences = file_size / 500;
     this->sequences.reserve(n_estimated_sequences);
 
-    // Allocate a container for the sequences
-    Protein protein;
-    std::string description;
-    bool in_description = false;
-
     auto start_processing = std::chrono::high_resolution_clock::now();
 
-    int n_threads = std::thread::hardware_concurrency();
-    if (n_threads == 0) n_threads = 1;
-
-    if (n_threads > 1) {
-        std::vector<std::thread> threads;
-        std::vector<result_struct> results;
-        results.resize(n_threads);
-        threads.reserve(n_threads);
-        auto bytes_per_thread = file_size / n_threads;
-        auto remainder = file_size - (bytes_per_thread * n_threads);
-        for (int i = 0; i < n_threads; i++) {
-            auto start_position = bytes_per_thread * i;
-            auto bytes_to_process = bytes_per_thread;
-            if (i == n_threads) bytes_to_process += remainder;
-            thread_args_struct args(results[i], source_path, file_buffer, file_size, start_position, bytes_to_process);
-            auto t = std::thread(LoadThreadProc, args);
-            threads.push_back(std::move(t));
-        }
-
-        for (int i = 0; i < n_threads; i++) {
-            threads[i].join();
-            for (auto sequence : results[i].load_results) {
-                this->sequences.push_back(std::move(sequence));
-            }
-        }
-        
-    } else {
-        // Run through the file and process protein sequences
-        for (uint64_t i = 0; i < file_size; i++) {
+    std::unique_ptr<ParseQueue> own_workers;
+    if (!workers) {
+        own_workers.reset(new ParseQueue());
+        workers = own_workers.get();
+    }
+
+    // Parse whole records as soon as they have been read: each time more of the file arrives, everything up
+    // to the last record start goes out in segments (or, with the index, blocks) to the parse workers.
+    // Deques keep the already queued segments and blocks in place while more are added.
+    std::deque<std::vector<Protein>> segments;
+    std::deque<record_block> blocks;
+    block_splitter splitter;
+    std::string index_path;
+    std::unique_ptr<previous_index> previous;
+    if (config.database_index) {
+        index_path = index_file_path(path, config);
+        previous.reset(new previous_index(index_path));
+    }
 
-            // We shouldn't have any NULs, but just in case...
-            if (file_buffer[i] == '\0') continue;
+    // The parse workers also build the prefilter signatures, for the configured digest mode only.
+    // Unchanged blocks keep the ones stored in the index if they were built the same way.
+    double signature_bin_width = config.mass_prefilter ? config.prefilter_bin_width : 0;
+    bool signature_gluc = config.gluc_digest;
+    bool reuse_signatures = previous && previous->signatures_match(signature_bin_width, signature_gluc);
+    auto load_cancelled = [cancellation]() { return cancellation && cancellation->cancelled(); };
+    {
+        ParseQueue::Group tasks(*workers);
+        size_t consumed = 0, available = 0;
+        while (consumed < file_size) {
+            if (load_cancelled()) {
+                reader.stop();
+                break;
+            }
+            available = reader.wait_for_more(available);
+            size_t limit = available == file_size ? file_size : last_record_start(file_buffer, consumed, available);
+            if (limit <= consumed) continue;
 
-            // Check if this is the beginning of a new sequence
-            if (!in_description && file_buffer[i] == '>') {
-                // Process the existing sequence
-                if (!protein.sequence.empty()) {
-                    protein.description = std::move(description);
-                    this->sequences.push_back(std::move(protein));
+            if (config.database_index) {
+                size_t first_new_block = blocks.size();
+                splitter.add(file_buffer, consumed, limit, limit == file_size, blocks);
+                for (size_t b = first_new_block; b < blocks.size(); b++) {
+                    record_block &block = blocks[b];
+                    if (previous->load(this->database_id, reuse_signatures, block) && (reuse_signatures || signature_bin_width <= 0)) continue;
+                    tasks.push([&block, file_buffer, load_cancelled, signature_bin_width, signature_gluc, this]() {
+                        if (load_cancelled()) return;
+                        if (!block.reused) parse_fasta(file_buffer, block.begin, block.end, this->database_id, block.proteins);
+                        build_block_signatures(block.proteins, signature_bin_width, signature_gluc);
+                    });
                 }
-                in_description = true;
-                protein.source_database = this->source_path;
-                protein.sequence.clear();
-                description.clear();
             } else {
-                // In an existing sequence. Check if we're still populating the description
-                if (in_description) {
-                    // Check if we've reached the end yet, signified by a newline character
-                    if (file_buffer[i] == '\r' || file_buffer[i] == '\n') {
-                        in_description = false;
-                    } else {
-                        description += file_buffer[i];
-                    }
-                } else {
-                    // Otherwise we're adding to the sequence.
-                    // Skip any newline or whitespace characters.
-                    if (isalpha(file_buffer[i])) protein.sequence.push_back(file_buffer[i]);
+                // Segments of about a megabyte, so small files still spread over the workers
+                size_t begin = consumed;
+                while (begin < limit) {
+                    size_t end = next_record_start(file_buffer, std::min(limit, begin + segment_bytes), limit);
+                    segments.emplace_back();
+                    std::vector<Protein> &segment = segments.back();
+                    tasks.push([&segment, file_buffer, begin, end, load_cancelled, signature_bin_width, signature_gluc, this]() {
+                        if (load_cancelled()) return;
+                        parse_fasta(file_buffer, begin, end, this->database_id, segment);
+                        build_block_signatures(segment, signature_bin_width, signature_gluc);
+                    });
+                    begin = end;
                 }
             }
+            consumed = limit;
         }
+        tasks.wait();
+    }
+    reader.join();
+
+    // An interrupted load is thrown away (and never written to the index); nothing will be searched
+    if (load_cancelled()) {
+        fprintf(stderr, "Loading %s was interrupted.\n", path.c_str());
+        return;
+    }
 
-        // Process the last sequence
-        if (!protein.sequence.empty()) {
-            protein.description = std::move(description);
-            this->sequences.push_back(protein);
+    // Put everything back together in file order
+    for (auto &segment : segments) {
+        for (auto &protein : segment) {
+            this->sequences.push_back(std::move(protein));
         }
     }
-    auto finish_processing = std::chrono::high_resolution_clock::now();
+    for (const auto &block : blocks) {
+        if (block.reused) ++this->n_blocks_reused;
+        else ++this->n_blocks_rebuilt;
+    }
+    this->signature_bin_width = signature_bin_width;
+    if (config.database_index) {
+        // Only rewrite the index if anything changed (including signatures it doesn't have yet)
+        if (this->n_blocks_rebuilt > 0 || blocks.empty() || (signature_bin_width > 0 && !reuse_signatures)) {
+            write_index(index_path, blocks, signature_bin_width, signature_gluc);
+        }
+        for (auto &block : blocks) {
+            for (auto &protein : block.proteins) {
+                this->sequences.push_back(std::move(protein));
+            }
+        }
+    }
+
+    DatabaseShard shard;
+    shard.begin = 0;
+    shard.end = (int)this->sequences.size();
+    shard.node = 0;
+    this->shards.push_back(shard);
+    if (config.numa_placement) this->place_on_numa_nodes();
 
-    delete[] file_buffer;
+    this->accession_order.resize(this->sequences.size());
+    for (int i = 0; i < (int)this->sequences.size(); i++) {
+        this->accession_order[i] = i;
+    }
+    std::sort(this->accession_order.begin(), this->accession_order.end(),
+        [this](int a, int b) { return this->sequences[a].accession < this->sequences[b].accession; });
+
+    if (config.precursor_mass > 0 || config.peptide_table) this->build_peptide_table(config.gluc_digest);
+    auto finish_processing = std::chrono::high_resolution_clock::now();
 
-    long long read_time = std::chrono::duration_cast<std::chrono::milliseconds>(finish_read - start_read).count();
+    // Reading and processing overlap, so processing time includes waiting on the read
+    long long read_time = reader.read_millis;
     long long process_time = std::chrono::duration_cast<std::chrono::milliseconds>(finish_processing - start_processing).count();
-    fprintf(stderr, "Imported %zd sequences. Reading time = %lld ms, processing time = %lld ms.\n", this->sequences.size(), read_time, process_time);
+    double megabytes = file_size / (1024.0 * 1024.0);
+    fprintf(stderr, "Imported %zd sequences from %s. Reading time = %lld ms (%.1f MB/s), processing time = %lld ms (%.1f MB/s).\n",
+        this->sequences.size(), path.c_str(), read_time, megabytes * 1000 / std::max(1LL, read_time), process_time, megabytes * 1000 / std::max(1LL, process_time));
+    if (config.database_index) {
+        fprintf(stderr, "Index refresh: %d blocks reused, %d rebuilt.\n", this->n_blocks_reused, this->n_blocks_rebuilt);
+    }
+}
+
+int Database::find_accession(const std::string &accession) const
+{
+    auto it = std::lower_bound(this->accession_order.begin(), this->accession_order.end(), accession,
+        [this](int i, const std::string &value) { return this->sequences[i].accession < value; });
+    if (it == this->accession_order.end() || this->sequences[*it].accession != accession) return -1;
+    return *it;
+}
+
+void Database::build_peptide_table(bool gluc_digest)
+{
+    this->peptide_table.clear();
+    this->peptide_table_gluc = gluc_digest;
+    for (int i = 0; i < (int)this->sequences.size(); i++) {
+        const Protein &protein = this->sequences[i];
+        // Sequences that failed validation have no masses
+        if (!protein.indexed()) continue;
+        int n_digests = protein.digest_count(gluc_digest);
+        for (int digest = 0; digest < n_digests; digest++) {
+            int begin, end;
+            protein.digest_range(gluc_digest, digest, begin, end);
+            if (!protein.range_has_masses(begin, end)) continue;
+            PeptideEntry entry;
+            entry.mass = residue_mass_sum(protein, begin, end) + peptide_water_mass;
+            entry.sequence_index = i;
+            entry.digest = digest;
+            this->peptide_table.push_back(entry);
+        }
+    }
+    this->peptide_table.shrink_to_fit();
+    std::sort(this->peptide_table.begin(), this->peptide_table.end(), [](const PeptideEntry &a, const PeptideEntry &b) {
+        if (a.mass != b.mass) return a.mass < b.mass;
+        if (a.sequence_index != b.sequence_index) return a.sequence_index < b.sequence_index;
+        return a.digest < b.digest;
+    });
+}
+
+void Database::build_signatures(double bin_width, bool gluc_digest)
+{
+    // A few hundred sequences per task
+    ParseQueue workers;
+    {
+        ParseQueue::Group tasks(workers);
+        const size_t per_task = 256;
+        for (size_t begin = 0; begin < this->sequences.size(); begin += per_task) {
+            tasks.push([this, begin, per_task, bin_width, gluc_digest]() {
+                size_t end = std::min(this->sequences.size(), begin + per_task);
+                for (size_t i = begin; i < end; i++) {
+                    this->sequences[i].build_signatures(bin_width, gluc_digest);
+                }
+            });
+        }
+    }
+    this->signature_bin_width = bin_width;
+    this->signature_gluc = gluc_digest;
+}
+
+void Database::peptide_window(double min_mass, double max_mass, const PeptideEntry *&begin, const PeptideEntry *&end) const
+{
+    const PeptideEntry *first = this->peptide_table.data();
+    const PeptideEntry *last = first + this->peptide_table.size();
+    begin = std::lower_bound(first, last, min_mass, [](const PeptideEntry &entry, double mass) { return entry.mass < mass; });
+    end = std::upper_bound(begin, last, max_mass, [](double mass, const PeptideEntry &entry) { return mass < entry.mass; });
+}
+
+// Interned database files. A deque, so references handed out stay valid as files are added.
+// Description offsets are only valid for the version of the file they were parsed from, so the
+// size and modification time are part of the key: reloading a changed file gives it a new ID and
+// leaves the one of the proteins still loaded from the old version alone.
+struct database_file {
+    std::string path;
+    uint64_t file_size;
+    time_t modified_time;
+};
+static std::mutex database_paths_mutex;
+static std::deque<database_file> database_files;
+static std::map<std::tuple<std::string, uint64_t, time_t>, uint16_t> database_ids;
+
+uint16_t intern_database_path(const std::string &path, uint64_t file_size, time_t modified_time)
+{
+    std::lock_guard<std::mutex> lock(database_paths_mutex);
+    auto key = std::make_tuple(path, file_size, modified_time);
+    auto it = database_ids.find(key);
+    if (it != database_ids.end()) return it->second;
+    if (database_files.size() > UINT16_MAX) throw std::invalid_argument("Too many database files.\n");
+    uint16_t database_id = (uint16_t)database_files.size();
+    database_files.push_back(database_file{ path, file_size, modified_time });
+    database_ids[key] = database_id;
+    return database_id;
+}
+
+const std::string &database_path(uint16_t database_id)
+{
+    std::lock_guard<std::mutex> lock(database_paths_mutex);
+    return database_files.at(database_id).path;
+}
+
+// False if the file on disk is no longer the version the database was loaded from
+static bool database_unchanged(uint16_t database_id)
+{
+    database_file file;
+    {
+        std::lock_guard<std::mutex> lock(database_paths_mutex);
+        file = database_files.at(database_id);
+    }
+    struct stat file_stat;
+    if (stat(file.path.c_str(), &file_stat) != 0) return false;
+    return (uint64_t)file_stat.st_size == file.file_size && file_stat.st_mtime == file.modified_time;
+}
+
+DescriptionReader::~DescriptionReader()
+{
+    for (auto &file : this->files) {
+        if (file.second) fclose(file.second);
+    }
+}
+
+std::string DescriptionReader::read(const Protein &protein)
+{
+    auto it = this->files.find(protein.database_id);
+    if (it == this->files.end()) {
+        const std::string &path = database_path(protein.database_id);
+        FILE *fp = fopen(path.c_str(), "rb");
+        if (!fp) fprintf(stderr, "Unable to open '%s' to read protein descriptions.\n", path.c_str());
+        if (fp && !database_unchanged(protein.database_id)) {
+            fprintf(stderr, "Warning: '%s' has changed since it was loaded; reporting accessions instead of protein descriptions.\n", path.c_str());
+            fclose(fp);
+            fp = nullptr;
+        }
+        it = this->files.insert(std::make_pair(protein.database_id, fp)).first;
+    }
+
+    std::string description(protein.description_length, '\0');
+    FILE *fp = it->second;
+    if (!fp || fseek64(fp, protein.description_offset, SEEK_SET) != 0 ||
+        fread(&description[0], 1, description.size(), fp) != description.size()) {
+        return protein.accession;
+    }
+    // Headers never contained NULs when parsed
+    description.erase(std::remove(description.begin(), description.end(), '\0'), description.end());
+    return description;
 }
@@ -1,20 +1,140 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "Configuration.h"
 #include "Protein.h"
 
+class CancellationToken;
+
+// Worker threads for parsing and building signatures, shared by databases loading at the same time so
+// the hardware threads go wherever there is work left. Each load queues its tasks in its own Group.
+class ParseQueue
+{
+public:
+    // The tasks of one load; destroying the group waits for them
+    class Group
+    {
+    public:
+        explicit Group(ParseQueue &queue);
+        ~Group();
+
+        void push(std::function<void()> task);
+
+        // Block until every task pushed so far has run
+        void wait();
+
+    private:
+        friend class ParseQueue;
+        ParseQueue &queue;
+        int n_pending;
+    };
+
+public:
+    // n_threads = 0: one per hardware thread
+    explicit ParseQueue(int n_threads = 0);
+    ~ParseQueue();
+
+private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable task_ready;
+    std::condition_variable task_done;
+    std::deque<std::pair<Group *, std::function<void()>>> tasks;
+    bool stopping;
+
+    void worker_loop();
+};
+
+// A contiguous range of sequences [begin, end) whose memory was placed on one NUMA node (by index into NumaTopology)
+struct DatabaseShard {
+    int begin;
+    int end;
+    int node;
+};
+
+// Database files are interned by path, size and modification time, so each Protein only stores a
+// small ID for the version of the file it was read from
+uint16_t intern_database_path(const std::string &path, uint64_t file_size, time_t modified_time);
+const std::string &database_path(uint16_t database_id);
+
+// One digest peptide in the mass-sorted peptide table
+struct PeptideEntry {
+    double mass;            // Monoisotopic peptide mass: residues + water
+    int sequence_index;
+    int digest;
+};
+
 class Database
 {
 public:
     std::string source_path;
+    uint16_t database_id;
     std::vector<Protein> sequences;
 
+    // Incremental index statistics (only set when config.database_index is enabled)
+    int n_blocks_reused;
+    int n_blocks_rebuilt;
+
+    // Bin width and digest mode the mass prefilter signatures were built for (width 0 if they weren't built)
+    double signature_bin_width;
+    bool signature_gluc;
+
+    // Without NUMA placement this is a single shard covering every sequence
+    std::vector<DatabaseShard> shards;
+
+    // Sequence indices sorted by accession, for find_accession()
+    std::vector<int> accession_order;
+
+    // Every digest with known residue masses, sorted by peptide mass (empty unless built)
+    std::vector<PeptideEntry> peptide_table;
+    bool peptide_table_gluc;    // Digest mode the table was built for
+
+public:
+    // Parsing overlaps with reading the file, on the workers (a queue of its own if null).
+    // If the cancellation token fires, loading stops early and leaves the database incomplete.
+    Database(std::string path, const Configuration &config, ParseQueue *workers = nullptr, const CancellationToken *cancellation = nullptr);
+
+    // Index of the sequence with this accession, or -1
+    int find_accession(const std::string &accession) const;
+
+    // Build peptide_table for the given digest mode (done at load time if the configuration asks for it)
+    void build_peptide_table(bool gluc_digest);
+
+    // Build the mass prefilter signatures for the given bin width and digest mode, replacing any others
+    // (done at load time for the configured ones if the configuration asks for them)
+    void build_signatures(double bin_width, bool gluc_digest);
+
+    // The peptide_table entries with min_mass <= mass <= max_mass, as [begin, end)
+    void peptide_window(double min_mass, double max_mass, const PeptideEntry *&begin, const PeptideEntry *&end) const;
+
+private:
+    void place_on_numa_nodes();
+};
+
+// Fetches protein descriptions from the database files, keeping each file open until destroyed
+class DescriptionReader
+{
 public:
-    Database(std::string path);
+    ~DescriptionReader();
+
+    // The protein's FASTA header without the '>' (its accession if the file can't be read, or has changed since it was loaded)
+    std::string read(const Protein &protein);
 
+private:
+    std::unordered_map<uint16_t, FILE *> files;
 };
 
 #endif // DATABASE_H
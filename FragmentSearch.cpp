@@ -2,261 +2,180 @@
 #include <stdexcept>
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <numeric>
 
 #include "FragmentSearch.h"
+#include "Numa.h"
+#include "ResultCache.h"
+#include "SearchEngine.h"
 
 // Implementation file for the main program logic
 
 
-// Amino acid list
-double get_amino_acid_mass(char aa)
+std::vector<Database> read_databases(const Configuration &config, const CancellationToken *cancellation)
 {
-    switch (aa) {
-    case 'A':
-        return 71.03711;
-    case 'R':
-        return 156.10111;
-    case 'N':
-        return 114.04293;
-    case 'D':
-        return 115.02694;
-    case 'C':
-        return 103.00919 + 57.0214; // Assume reduction-alkylation
-    case 'E':
-        return 129.04259;
-    case 'Q':
-        return 128.05858;
-    case 'G':
-        return 57.02146;
-    case 'H':
-        return 137.05891;
-    case 'I':
-        return 113.08406;
-    case 'L':
-        return 113.08406;
-    case 'K':
-        return 128.09496;
-    case 'M':
-        return 131.04049;
-    case 'F':
-        return 147.06841;
-    case 'P':
-        return 97.05276;
-    case 'S':
-        return 87.03203;
-    case 'T':
-        return 101.04768;
-    case 'W':
-        return 186.07931;
-    case 'Y':
-        return 163.06333;
-    case 'V':
-        return 99.06841;
-    default:
-        throw std::invalid_argument("Unknown amino acid");
-    }
+    // Load every file at once; their parsing shares one set of workers, so a large file gets every
+    // thread once the small ones are done
+    size_t n_files = config.databases.size();
+    ParseQueue workers;
 
-}
+    std::vector<std::unique_ptr<Database>> loaded(n_files);
+    std::vector<std::exception_ptr> errors(n_files);
+    std::vector<std::thread> threads;
+    threads.reserve(n_files);
+    for (size_t i = 0; i < n_files; i++) {
+        threads.push_back(std::thread([&, i]() {
+            try {
+                loaded[i].reset(new Database(config.databases[i], config, &workers, cancellation));
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    for (auto &error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
 
-std::vector<std::vector<char>> run_gluc_digest(const std::vector<char> &sequence)
-{
-    // Split on 'E' if present
-    std::vector<std::vector<char>> results;
-    auto current = sequence.begin();
-    auto it = current;
-    while ((it = std::find(current, sequence.end(), 'E')) != sequence.end()) {
-        std::vector<char> subsequence(current, it + 1);
-        current = it + 1;
-        results.push_back(std::move(subsequence));
+    std::vector<Database> databases;
+    databases.reserve(n_files);
+    for (auto &database : loaded) {
+        databases.push_back(std::move(*database));
     }
-    results.push_back(std::move(std::vector<char>(current, sequence.end())));
-    return results;
+    return databases;
 }
 
-void fragment_sequence(const std::vector<char> &sequence, std::vector<double> &fragment_list)
+// SIGINT cancels the running search instead of killing the process, so the matches found so far are
+// still written; a second SIGINT kills it as usual
+static CancellationToken *interrupt_token = nullptr;
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void interrupt_handler(int signal_number)
 {
-    // Run forwards; get B ions
-    double mass = 0;
-    for (int i = 0; i < sequence.size(); i++) {
-        mass += get_amino_acid_mass(sequence[i]);
-        // handle terminus; not necessary on N terminus in neutral state?
-        fragment_list.push_back(mass);
-    }
-    // Run backwards; get Y ions
-    mass = 0;
-    for (int i = (int)sequence.size() - 1; i >= 0; i--) {
-        mass += get_amino_acid_mass(sequence[i]);
-        // handle C terminus
-        mass += 18.01088;
-        fragment_list.push_back(mass);
-    }
+    interrupted = 1;
+    if (interrupt_token) interrupt_token->cancel();
+    std::signal(signal_number, SIG_DFL);
 }
 
-int search_sequence(const std::vector<char> &sequence, const std::vector<double> &mass_list, double tolerance, bool gluc_digest, std::vector<std::vector<char>> &searched_sequences)
+// Reports the progress of a running search on stderr every interval_seconds until destroyed
+class progress_reporter
 {
-    std::vector<std::vector<char>> sequences;
-    int match_count = 0;
-
-    // Check if we want to do a GluC digest first
-    if (gluc_digest) {
-        sequences = run_gluc_digest(sequence);
-    } else {
-        sequences.push_back(sequence);
+public:
+    progress_reporter(const SearchProgress &progress, double interval_seconds) : progress(progress)
+    {
+        this->stopping = false;
+        if (interval_seconds <= 0) return;
+        this->thread = std::thread(&progress_reporter::report_proc, this, interval_seconds);
     }
-    searched_sequences = sequences;
-
-    // Catch exceptions for unknown amino acids. FASTA format supports X for unknown, B/Z for ambiguous, etc. Just skip those...
-    for (const auto &seq : sequences) {
-        try {
-            std::vector<double> fragments;
-            fragment_sequence(seq, fragments);
 
-            // Return true if all of the target masses are in the fragment list (false otherwise)
-            bool all_found = true;
-            for (auto mass : mass_list) {
-                bool mass_found = false;
-                for (auto f : fragments) {
-                    if (std::abs(mass - f) < tolerance) {
-                        mass_found = true;
-                        break;
-                    }
-                }
-                if (!mass_found) {
-                    all_found = false;
-                    break;
-                }
-            }
-            if (all_found) ++match_count;
-        } catch (const std::invalid_argument) {
-            // We could print a warning, but there are too many to make that practical.
+    ~progress_reporter()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
         }
+        this->stop.notify_all();
+        if (this->thread.joinable()) this->thread.join();
     }
 
-    return match_count;
-}
+private:
+    const SearchProgress &progress;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable stop;
+    bool stopping;
 
-// Argument struct for each thread
-struct helper_thread_args_struct {
-    helper_thread_args_struct(std::vector<Protein> &sequences, const std::vector<double> &mass_list, bool gluc_digest) : sequences(sequences), mass_list(mass_list), gluc_digest(gluc_digest)
+    void report_proc(double interval_seconds)
     {
-        start_index = -1;
-        stop_index = -1;
-        tolerance = 0;
-    }
-
-    std::vector<Protein> &sequences;
-    const std::vector<double> &mass_list;
-    bool gluc_digest;
-    double tolerance;
-    int start_index;
-    int stop_index;
-    Results result;
-};
+        auto start = std::chrono::steady_clock::now();
+        auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(interval_seconds));
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (!this->stop.wait_for(lock, interval, [this]() { return this->stopping; })) {
+            uint64_t n_sequences = this->progress.n_sequences.load(std::memory_order_relaxed);
+            uint64_t total_sequences = this->progress.total_sequences.load(std::memory_order_relaxed);
+            uint64_t n_residues = this->progress.n_residues.load(std::memory_order_relaxed);
+            uint64_t total_residues = this->progress.total_residues.load(std::memory_order_relaxed);
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-
-// Helper thread to run calculations
-int SearchThreadProc(struct helper_thread_args_struct *p_args)
-{
-    int n_matches = 0;
-    int result_count;
-    int n_sequences = p_args->stop_index - p_args->start_index + 1;
-    p_args->result.matches.reserve(n_sequences);
-    p_args->result.searched_sequence_lengths.reserve(n_sequences);
-    p_args->result.searched_digest_lengths.reserve(n_sequences);
-    p_args->result.digests_per_sequence.reserve(n_sequences);
-    for (int i = p_args->start_index; i <= p_args->stop_index; i++) {
-        if (p_args->sequences[i].sequence_valid()) {
-            p_args->result.n_searched_sequences++;
-            if (result_count = search_sequence(p_args->sequences[i].sequence, p_args->mass_list, p_args->tolerance, p_args->gluc_digest, p_args->sequences[i].digested_sequences)) {
-                p_args->result.matches.push_back(p_args->sequences[i]);
-                p_args->result.n_matched_sequences += result_count;
-            }
-        } else {
-            p_args->result.n_skipped_sequences++;
-        }
-        p_args->result.n_digest_sequences += (int)p_args->sequences[i].digested_sequences.size();
-        p_args->result.searched_sequence_lengths.push_back((int)p_args->sequences[i].sequence.size());
-        p_args->result.digests_per_sequence.push_back((int)p_args->sequences[i].digested_sequences.size());
-        std::vector<int> digest_sizes;
-        digest_sizes.reserve(p_args->sequences[i].digested_sequences.size());
-        for (const auto &seq : p_args->sequences[i].digested_sequences) {
-            digest_sizes.push_back((int)seq.size());
+            // Search time goes with the number of residues, so extrapolate from those
+            double fraction = total_residues ? (double)n_residues / total_residues : 0;
+            fprintf(stderr, "Progress: %llu of %llu sequences, %.1f%% of residues, %.1f s elapsed",
+                (unsigned long long)n_sequences, (unsigned long long)total_sequences, fraction * 100, elapsed);
+            if (fraction > 0) fprintf(stderr, ", ETA %.1f s", elapsed / fraction - elapsed);
+            fputs(".\n", stderr);
         }
-        p_args->result.searched_digest_lengths.push_back(std::move(digest_sizes));
     }
+};
 
-    return 0;
-}
-
-std::vector<Database> read_databases(const Configuration &config)
-{
-    std::vector<Database> databases;
-    for (auto path : config.databases) {
-        Database database = Database(path);
-        databases.push_back(std::move(database));
-    }
-    return databases;
-}
-
-Results search_fragments(const Configuration &config, std::vector<Database> &databases)
+Results search_fragments(const Configuration &config, const std::vector<Database> &databases, const CancellationToken *cancellation)
 {
-    int n_threads = config.num_search_threads;
-    // If unspecified, query how many hardware threads we can use at once
-    if (n_threads == 0) {
-        n_threads = std::thread::hardware_concurrency();
-    }
-    // In case hardware_concurrency() isn't supported, default to single-threaded
-    if (n_threads == 0) n_threads = 1;
-
-    // Allocate memory to store the input information for each thread + its results
-    std::vector<struct helper_thread_args_struct> thread_args;
-    std::vector<Results> database_results;
-    database_results.reserve(databases.size());
-    for (auto &db : databases) {
-        int sequences_seen = (int)db.sequences.size();
-        // Setup how many sequences each thread needs to search
-        int n_sequences_per_thread = sequences_seen / n_threads;
-        int excess = sequences_seen - (n_sequences_per_thread * n_threads);
+    // NUMA placement is pointless unless the workers stay on their nodes
+    ThreadAffinity affinity = config.thread_affinity;
+    if (config.numa_placement && affinity == ThreadAffinity::None) affinity = ThreadAffinity::Numa;
+    WorkerThreadPool pool(config.num_search_threads, affinity);
 
-        for (int i = 0; i < n_threads; i++) {
-            // Setup input arguments for each thread
-            struct helper_thread_args_struct args(db.sequences, config.target_masses, config.gluc_digest);
-            args.tolerance = config.mass_tolerance;
-            args.start_index = i * n_sequences_per_thread;
-            args.stop_index = (i + 1) * n_sequences_per_thread - 1;
-            if (i + 1 == n_threads) args.stop_index += excess;
-            thread_args.push_back(args);
+    // Exact matches stream in from every thread; remember which sequences they were in and
+    // put them back in database order afterwards
+    std::vector<std::pair<int, int>> matched_sequences;
+    std::vector<PeptideMatch> top_matches;
+    DescriptionReader descriptions;
+    auto on_match = [&](const SearchMatch &match) {
+        if (!config.partial_scoring) {
+            matched_sequences.push_back(std::make_pair(match.database_index, match.sequence_index));
+            return;
         }
+        // Partial scoring: these arrive best first, already cut down to top_k
+        PeptideMatch peptide_match;
+        peptide_match.score = match.score;
+        peptide_match.n_matched_targets = match.n_matched_targets;
+        peptide_match.source_database = database_path(match.protein->database_id);
+        peptide_match.description = descriptions.read(*match.protein);
+        peptide_match.peptide = std::string(match.protein->sequence.begin() + match.begin, match.protein->sequence.begin() + match.end);
+        top_matches.push_back(std::move(peptide_match));
+    };
 
-        // Create a separate thread for each hardware thread
-        std::vector<std::thread> threads;
-        threads.resize(n_threads);
-        for (int i = 0; i < n_threads; i++) {
-            threads[i] = std::thread(SearchThreadProc, &thread_args[i]);
-        }
-
-        // Wait for everything to finish
-        for (int i = 0; i < n_threads; i++) {
-            threads[i].join();
-        }
+    SearchProgress progress;
+    Results results;
+    {
+        progress_reporter reporter(progress, config.progress_interval_seconds);
+        results = search_databases(databases, SearchQuery::FromConfiguration(config), on_match, &pool, cancellation, &progress);
+    }
 
-        // All the threads are done now, add up the results
-        std::vector<Results> thread_results;
-        thread_results.reserve(n_threads);
-        for (int i = 0; i < n_threads; i++) {
-            thread_results.push_back(std::move(thread_args[i].result));
-        }
-        database_results.push_back(Results::Combine(thread_results));
+    std::sort(matched_sequences.begin(), matched_sequences.end());
+    matched_sequences.erase(std::unique(matched_sequences.begin(), matched_sequences.end()), matched_sequences.end());
+    for (const auto &matched : matched_sequences) {
+        results.matches.push_back(databases[matched.first].sequences[matched.second]);
     }
-    return Results::Combine(database_results);
+    results.top_matches = std::move(top_matches);
+    return results;
 }
 
 void write_results(const Configuration &config, const Results &results, FILE *output_file)
 {
+    if (config.partial_scoring) {
+        int rank = 0;
+        for (const auto &match : results.top_matches) {
+            ++rank;
+            fprintf(output_file, "%d: %s [%s]\n", rank, match.description.c_str(), match.source_database.c_str());
+            fprintf(output_file, "\t%s\n", match.peptide.c_str());
+            fprintf(output_file, "\t\tScore %.4lf, %d of %zd targets matched\n\n", match.score, match.n_matched_targets, config.target_masses.size());
+        }
+        return;
+    }
+
+    // Descriptions are only kept as file offsets; fetch them now
+    DescriptionReader descriptions;
     int current_seq = 0;
     for (const auto &protein : results.matches) {
         ++current_seq;
-        fprintf(output_file, "%d: %s [%s]\n", current_seq, protein.description.c_str(), protein.source_database.c_str());
+        fprintf(output_file, "%d: %s [%s]\n", current_seq, descriptions.read(protein).c_str(), database_path(protein.database_id).c_str());
         fputc('\t', output_file);
         for (const auto c : protein.sequence) {
             fputc(c, output_file);
@@ -264,10 +183,13 @@ void write_results(const Configuration &config, const Results &results, FILE *ou
         fputc('\n', output_file);
         if (config.gluc_digest) {
             fprintf(output_file, "\t\tGluC fragments:\n");
-            for (const auto &fragment : protein.digested_sequences) {
+            int n_digests = protein.digest_count(config.gluc_digest);
+            for (int digest = 0; digest < n_digests; digest++) {
+                int begin, end;
+                protein.digest_range(config.gluc_digest, digest, begin, end);
                 fputs("\t\t", output_file);
-                for (const auto c : fragment) {
-                    fputc(c, output_file);
+                for (int i = begin; i < end; i++) {
+                    fputc(protein.sequence[i], output_file);
                 }
                 fputc('\n', output_file);
             }
@@ -278,19 +200,48 @@ void write_results(const Configuration &config, const Results &results, FILE *ou
 
 Results run_fragment_search(const Configuration &config, FILE *output_file)
 {
-    // Open up the database files
+    // Serve the results straight from the cache if this exact search has been run before
     auto start_database_reading = std::chrono::high_resolution_clock::now();
-    auto databases = read_databases(config);
+    bool report_numa = config.numa_placement || config.thread_affinity != ThreadAffinity::None;
+    NumaCounters start_numa_counters = NumaCounters::Read();
+    ResultCache cache(config);
+    Results results;
+    bool cache_hit = cache.lookup(results, output_file);
+
+    // From here on, SIGINT stops the search early rather than killing the process
+    CancellationToken cancellation;
+    interrupt_token = &cancellation;
+    auto previous_handler = std::signal(SIGINT, interrupt_handler);
+
+    // Open up the database files
+    std::vector<Database> databases;
+    if (!cache_hit) databases = read_databases(config, &cancellation);
     auto finish_database_reading = std::chrono::high_resolution_clock::now();
 
     // Run the database search
     auto start_fragment_search = std::chrono::high_resolution_clock::now();
-    auto results = search_fragments(config, databases);
+    // An interrupted load leaves nothing worth searching
+    bool load_cancelled = !cache_hit && cancellation.cancelled();
+    if (load_cancelled) results.cancelled = true;
+    else if (!cache_hit) results = search_fragments(config, databases, &cancellation);
     auto finish_fragment_search = std::chrono::high_resolution_clock::now();
 
-    // Write the results to disk
+    std::signal(SIGINT, previous_handler);
+    interrupt_token = nullptr;
+    if (load_cancelled) {
+        fprintf(stderr, "Interrupted while reading the databases; nothing was searched.\n");
+    } else if (results.cancelled) {
+        fprintf(stderr, "Search %s after %d of %zd sequences; writing the partial results.\n", interrupted ? "interrupted" : "stopped by budget",
+            results.n_searched_sequences + results.n_skipped_sequences,
+            std::accumulate(databases.begin(), databases.end(), (size_t)0, [](size_t n, const Database &db) { return n + db.sequences.size(); }));
+    }
+
+    // Write the results to disk (partial results are never cached)
     auto start_writing_results = std::chrono::high_resolution_clock::now();
-    write_results(config, results, output_file);
+    if (!cache_hit) {
+        write_results(config, results, output_file);
+        if (!results.cancelled) cache.store(config, results);
+    }
     auto finish_writing_results = std::chrono::high_resolution_clock::now();
 
     auto file_reading_time = finish_database_reading - start_database_reading;
@@ -303,6 +254,22 @@ Results run_fragment_search(const Configuration &config, FILE *output_file)
     long long writing_millis = std::chrono::duration_cast<std::chrono::milliseconds>(writing_time).count();
     long long total_millis = std::chrono::duration_cast<std::chrono::milliseconds>(total_time).count();
     fprintf(stderr, "Elapsed time: %lld ms reading, %lld ms searching, %lld ms writing (%lld ms total).\n", file_millis, searching_millis, writing_millis, total_millis);
+    if (!cache_hit && config.precursor_mass > 0) {
+        fprintf(stderr, "Precursor window %.4lf +/- %.4lf Da: %d candidate peptides.\n", config.precursor_mass, config.precursor_tolerance, results.n_digest_sequences);
+    }
+    if (!cache_hit && config.mass_prefilter) {
+        fprintf(stderr, "Mass prefilter rejected %d of %d digests (%d skipped, signature saturated).\n", results.n_prefiltered_digests, results.n_digest_sequences,
+            results.n_saturated_digests);
+    }
+    NumaCounters finish_numa_counters = NumaCounters::Read();
+    if (report_numa && finish_numa_counters.available) {
+        fprintf(stderr, "NUMA page allocations (system-wide, during the run): %llu node-local, %llu remote.\n",
+            (unsigned long long)(finish_numa_counters.local_node - start_numa_counters.local_node),
+            (unsigned long long)(finish_numa_counters.other_node - start_numa_counters.other_node));
+    }
+    if (cache.enabled()) {
+        fprintf(stderr, "Result cache: %d hits, %d misses.\n", cache.n_hits, cache.n_misses);
+    }
 
     return std::move(results);
 }
@@ -7,12 +7,15 @@
 #include "Database.h"
 #include "Results.h"
 
+class CancellationToken;
+
 // Core header file with API definitions
+// (the command-line flow; for embedding the search in other programs see SearchEngine.h)
 // Main execution function
 Results run_fragment_search(const Configuration &config, FILE *output_file);
 
-std::vector<Database> read_databases(const Configuration &config);
-Results search_fragments(const Configuration &config, std::vector<Database> &databases);
+std::vector<Database> read_databases(const Configuration &config, const CancellationToken *cancellation = nullptr);
+Results search_fragments(const Configuration &config, const std::vector<Database> &databases, const CancellationToken *cancellation = nullptr);
 void write_results(const Configuration &config, const Results &results, FILE *output_file);
 
 #endif
@@ -0,0 +1,21 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit FNV-1a, used for content fingerprints of database files and record blocks
+const uint64_t fnv_offset_basis = 14695981039346656037ULL;
+const uint64_t fnv_prime = 1099511628211ULL;
+
+inline uint64_t fnv1a(const void *data, size_t n_bytes, uint64_t hash = fnv_offset_basis)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < n_bytes; i++) {
+        hash ^= bytes[i];
+        hash *= fnv_prime;
+    }
+    return hash;
+}
+
+#endif // HASH_H
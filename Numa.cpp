@@ -0,0 +1,176 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "Numa.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Parse a sysfs list such as "0-3,8-11"
+static std::vector<int> parse_id_list(const char *text)
+{
+    std::vector<int> ids;
+    const char *p = text;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) break;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long id = first; id <= last; id++) {
+            ids.push_back((int)id);
+        }
+        if (*p == ',') ++p;
+        else break;
+    }
+    return ids;
+}
+
+static bool read_sysfs_line(const std::string &path, char *buffer, size_t size)
+{
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp) return false;
+    bool ok = fgets(buffer, (int)size, fp) != nullptr;
+    fclose(fp);
+    return ok;
+}
+
+// CPUs this process is allowed to run on (empty if unknown)
+static std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) != 0) return cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpu_set)) cpus.push_back(cpu);
+    }
+#endif
+    return cpus;
+}
+
+static NumaTopology detect_topology()
+{
+    NumaTopology topology;
+    std::vector<int> allowed = allowed_cpus();
+    char buffer[4096];
+    if (read_sysfs_line("/sys/devices/system/node/online", buffer, sizeof(buffer))) {
+        for (auto node : parse_id_list(buffer)) {
+            std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+            if (!read_sysfs_line(path, buffer, sizeof(buffer))) continue;
+            std::vector<int> cpus = parse_id_list(buffer);
+            if (!allowed.empty()) {
+                cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&](int cpu) { return !std::binary_search(allowed.begin(), allowed.end(), cpu); }), cpus.end());
+            }
+            // Memory-only nodes (or nodes we may not run on) have no CPUs for workers
+            if (cpus.empty()) continue;
+            topology.node_ids.push_back(node);
+            topology.node_cpus.push_back(cpus);
+        }
+    }
+
+    // Fallback: one node with every (allowed) CPU
+    if (topology.node_ids.empty()) {
+        std::vector<int> cpus = allowed;
+        int n_cpus = std::thread::hardware_concurrency();
+        if (n_cpus == 0) n_cpus = 1;
+        for (int i = 0; cpus.empty() && i < n_cpus; i++) {
+            cpus.push_back(i);
+        }
+        if (cpus.empty()) cpus.push_back(0);
+        topology.node_ids.push_back(0);
+        topology.node_cpus.push_back(cpus);
+    }
+    return topology;
+}
+
+const NumaTopology &NumaTopology::Get()
+{
+    static const NumaTopology topology = detect_topology();
+    return topology;
+}
+
+int NumaTopology::node_count() const
+{
+    return (int)this->node_ids.size();
+}
+
+int NumaTopology::total_cpus() const
+{
+    int n_cpus = 0;
+    for (const auto &cpus : this->node_cpus) {
+        n_cpus += (int)cpus.size();
+    }
+    return n_cpus;
+}
+
+int NumaTopology::cpu_for_worker(int worker, int &node) const
+{
+    int slot = worker % this->total_cpus();
+    for (node = 0; node < this->node_count(); node++) {
+        if (slot < (int)this->node_cpus[node].size()) return this->node_cpus[node][slot];
+        slot -= (int)this->node_cpus[node].size();
+    }
+    node = 0;
+    return this->node_cpus[0][0];
+}
+
+bool pin_current_thread(const std::vector<int> &cpus)
+{
+#ifdef __linux__
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (auto cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &cpu_set);
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+void warn_pinning_failed()
+{
+    static std::once_flag warned;
+    std::call_once(warned, []() {
+        fprintf(stderr, "Warning: unable to pin threads to their CPUs; NUMA placement and thread affinity are not in effect.\n");
+    });
+}
+
+NumaCounters NumaCounters::Read()
+{
+    NumaCounters counters;
+    counters.available = false;
+    counters.local_node = 0;
+    counters.other_node = 0;
+
+    const NumaTopology &topology = NumaTopology::Get();
+    for (auto node : topology.node_ids) {
+        std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/numastat";
+        FILE *fp = fopen(path.c_str(), "r");
+        if (!fp) continue;
+        char name[64];
+        unsigned long long value;
+        while (fscanf(fp, "%63s %llu", name, &value) == 2) {
+            if (strcmp(name, "local_node") == 0) counters.local_node += value;
+            else if (strcmp(name, "other_node") == 0) counters.other_node += value;
+        }
+        fclose(fp);
+        counters.available = true;
+    }
+    return counters;
+}
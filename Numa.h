@@ -0,0 +1,46 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <cstdint>
+#include <vector>
+
+// NUMA topology and thread placement (Linux). Anywhere the topology isn't exposed this falls back
+// to a single node holding every CPU, and pinning does nothing. Only CPUs the process may run on
+// (its affinity mask, e.g. under taskset or a container cpuset) are included.
+class NumaTopology
+{
+public:
+    std::vector<int> node_ids;                  // OS node number of each node index
+    std::vector<std::vector<int>> node_cpus;    // CPUs of each node index
+
+public:
+    // Detected once, on first use
+    static const NumaTopology &Get();
+
+    int node_count() const;
+    int total_cpus() const;
+
+    // CPU for a worker pinned to a single core (consecutive workers fill one node before the next)
+    int cpu_for_worker(int worker, int &node) const;
+};
+
+// Restrict the calling thread to the given CPUs; returns false if that isn't supported or fails
+bool pin_current_thread(const std::vector<int> &cpus);
+
+// Print a warning (once per process) that a thread couldn't be pinned, so placement isn't as requested
+void warn_pinning_failed();
+
+// System-wide page allocation counters summed over all nodes (/sys/devices/system/node/node*/numastat):
+// allocations satisfied on the node the allocating thread ran on vs. on another node
+class NumaCounters
+{
+public:
+    bool available;
+    uint64_t local_node;
+    uint64_t other_node;
+
+public:
+    static NumaCounters Read();
+};
+
+#endif // NUMA_H
@@ -1,6 +1,102 @@
 #include "Protein.h"
 
+#include <cctype>
+#include <cmath>
 #include <cstring>
+#include <stdexcept>
+#include <utility>
+
+// Amino acid list
+double get_amino_acid_mass(char aa)
+{
+    switch (aa) {
+    case 'A':
+        return 71.03711;
+    case 'R':
+        return 156.10111;
+    case 'N':
+        return 114.04293;
+    case 'D':
+        return 115.02694;
+    case 'C':
+        return 103.00919 + 57.0214; // Assume reduction-alkylation
+    case 'E':
+        return 129.04259;
+    case 'Q':
+        return 128.05858;
+    case 'G':
+        return 57.02146;
+    case 'H':
+        return 137.05891;
+    case 'I':
+        return 113.08406;
+    case 'L':
+        return 113.08406;
+    case 'K':
+        return 128.09496;
+    case 'M':
+        return 131.04049;
+    case 'F':
+        return 147.06841;
+    case 'P':
+        return 97.05276;
+    case 'S':
+        return 87.03203;
+    case 'T':
+        return 101.04768;
+    case 'W':
+        return 186.07931;
+    case 'Y':
+        return 163.06333;
+    case 'V':
+        return 99.06841;
+    default:
+        throw std::invalid_argument("Unknown amino acid");
+    }
+
+}
+
+// Residue masses by character (0 if unknown), so the fragment loops don't go through get_amino_acid_mass()
+struct residue_mass_table {
+    double masses[256];
+
+    residue_mass_table()
+    {
+        for (int c = 0; c < 256; c++) {
+            try {
+                this->masses[c] = get_amino_acid_mass((char)c);
+            } catch (const std::invalid_argument &) {
+                this->masses[c] = 0;
+            }
+        }
+    }
+};
+static const residue_mass_table residue_mass_lookup;
+
+static inline double residue_mass(char aa)
+{
+    return residue_mass_lookup.masses[(unsigned char)aa];
+}
+
+std::string parse_accession(const char *header, size_t length)
+{
+    size_t word_length = 0;
+    while (word_length < length && !isspace((unsigned char)header[word_length])) word_length++;
+    const char *word_end = header + word_length;
+
+    const char *first_bar = (const char *)memchr(header, '|', word_length);
+    if (!first_bar) return std::string(header, word_end);
+    const char *accession = first_bar + 1;
+    const char *second_bar = (const char *)memchr(accession, '|', word_end - accession);
+    return std::string(accession, second_bar ? second_bar : word_end);
+}
+
+Protein::Protein()
+{
+    this->database_id = 0;
+    this->description_length = 0;
+    this->description_offset = 0;
+}
 
 bool Protein::sequence_valid() const
 {
@@ -11,3 +107,210 @@ bool Protein::sequence_valid() const
     }
     return true;
 }
+
+void Protein::build_index()
+{
+    this->digest_ends.clear();
+    this->unknown_residues.clear();
+    if (!this->sequence_valid()) return;
+
+    // GluC cleaves after each 'E'. A trailing empty digest is kept, matching a plain split on 'E'.
+    int n = (int)this->sequence.size();
+    for (int i = 0; i < n; i++) {
+        if (this->sequence[i] == 'E') this->digest_ends.push_back(i + 1);
+    }
+    this->digest_ends.push_back(n);
+
+    // Note unknown amino acids (e.g. lowercase 'c'); any digest containing one is never matched
+    for (int i = 0; i < n; i++) {
+        if (residue_mass(this->sequence[i]) == 0) this->unknown_residues.push_back(i);
+    }
+}
+
+// A valid sequence always has at least one (possibly empty) digest
+bool Protein::indexed() const
+{
+    return !this->digest_ends.empty();
+}
+
+int Protein::digest_count(bool gluc_digest) const
+{
+    if (!this->indexed()) return 0;
+    return gluc_digest ? (int)this->digest_ends.size() : 1;
+}
+
+void Protein::digest_range(bool gluc_digest, int digest, int &begin, int &end) const
+{
+    if (!gluc_digest) {
+        begin = 0;
+        end = (int)this->sequence.size();
+        return;
+    }
+    begin = digest > 0 ? this->digest_ends[digest - 1] : 0;
+    end = this->digest_ends[digest];
+}
+
+bool Protein::range_has_masses(int begin, int end) const
+{
+    for (auto position : this->unknown_residues) {
+        if (position >= begin && position < end) return false;
+    }
+    return true;
+}
+
+double residue_mass_sum(const Protein &protein, int begin, int end)
+{
+    double mass = 0;
+    for (int i = begin; i < end; i++) {
+        mass += residue_mass(protein.sequence[i]);
+    }
+    return mass;
+}
+
+// Calculate the B and Y ion masses of residues [begin, end)
+void fragment_sequence(const Protein &protein, int begin, int end, std::vector<double> &fragment_list)
+{
+    const std::vector<char> &sequence = protein.sequence;
+    // Run forwards; get B ions
+    double mass = 0;
+    for (int i = begin; i < end; i++) {
+        mass += residue_mass(sequence[i]);
+        // handle terminus; not necessary on N terminus in neutral state?
+        fragment_list.push_back(mass);
+    }
+    // Run backwards; get Y ions
+    mass = 0;
+    for (int i = end - 1; i >= begin; i--) {
+        mass += residue_mass(sequence[i]);
+        // handle C terminus
+        mass += water_mass;
+        fragment_list.push_back(mass);
+    }
+}
+
+// Decoy residue k of n is original residue end - 2 - k, except the last, which stays at end - 1
+void reversed_decoy_fragments(const Protein &protein, int begin, int end, std::vector<double> &fragment_list)
+{
+    const std::vector<char> &sequence = protein.sequence;
+    int n = end - begin;
+    // Nothing to reverse; otherwise every residue read below lies in [begin, end)
+    if (n <= 0) return;
+    // B ions: the first k + 1 decoy residues are original residues end - 2 down to end - 2 - k
+    double mass = 0;
+    for (int i = end - 2; i >= begin; i--) {
+        mass += residue_mass(sequence[i]);
+        fragment_list.push_back(mass);
+    }
+    double c_terminal = residue_mass(sequence[end - 1]);
+    fragment_list.push_back(mass + c_terminal);
+    // Y ions: decoy residues [k, n) are original residues [begin, end - 1 - k) plus the C-terminal one
+    mass = c_terminal;
+    fragment_list.push_back(mass + water_mass);
+    for (int i = begin; i < end - 1; i++) {
+        mass += residue_mass(sequence[i]);
+        fragment_list.push_back(mass + water_mass * (i - begin + 2));
+    }
+}
+
+void shuffled_decoy_fragments(const Protein &protein, int begin, int end, uint64_t seed, std::vector<double> &residue_masses, std::vector<double> &fragment_list)
+{
+    int n = end - begin;
+    residue_masses.clear();
+    if (n <= 0) return;
+    for (int i = begin; i < end; i++) {
+        residue_masses.push_back(residue_mass(protein.sequence[i]));
+    }
+
+    // Fisher-Yates over all but the C-terminal residue, drawing from splitmix64
+    uint64_t state = seed;
+    for (int i = n - 2; i > 0; i--) {
+        state += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        std::swap(residue_masses[i], residue_masses[(size_t)(z % (uint64_t)(i + 1))]);
+    }
+
+    // Run forwards; get B ions
+    double mass = 0;
+    for (int k = 0; k < n; k++) {
+        mass += residue_masses[k];
+        fragment_list.push_back(mass);
+    }
+    // Run backwards; get Y ions
+    mass = 0;
+    for (int k = n - 1; k >= 0; k--) {
+        mass += residue_masses[k];
+        fragment_list.push_back(mass + water_mass * (n - k));
+    }
+}
+
+void MassSignature::clear()
+{
+    for (auto &word : this->bits) word = 0;
+}
+
+// Scatter bins over the 256 bits with a multiplicative hash (the top 8 bits of the product pick the bit)
+void MassSignature::add_bin(int64_t bin)
+{
+    uint64_t bit = ((uint64_t)bin * 0x9E3779B97F4A7C15ULL) >> 56;
+    this->bits[bit >> 6] |= 1ULL << (bit & 63);
+}
+
+bool MassSignature::has_bin(int64_t bin) const
+{
+    uint64_t bit = ((uint64_t)bin * 0x9E3779B97F4A7C15ULL) >> 56;
+    return (this->bits[bit >> 6] >> (bit & 63)) & 1;
+}
+
+// Above 3/4 of the bits set, a query with two targets would still pass more than half the time
+bool MassSignature::saturated() const
+{
+    int n_set = 0;
+    for (auto word : this->bits) {
+        for (; word; word &= word - 1) ++n_set;
+    }
+    return n_set > 192;
+}
+
+bool MassSignature::contains(const MassSignature &query) const
+{
+    return ((this->bits[0] & query.bits[0]) == query.bits[0]) &&
+        ((this->bits[1] & query.bits[1]) == query.bits[1]) &&
+        ((this->bits[2] & query.bits[2]) == query.bits[2]) &&
+        ((this->bits[3] & query.bits[3]) == query.bits[3]);
+}
+
+// Each fragment sets the two bins nearest to it, so any target within bin_width / 2 of a fragment
+// is guaranteed to find the bin floor(target / bin_width) set
+static void add_fragment_bins(const std::vector<double> &fragments, double bin_width, MassSignature &signature)
+{
+    signature.clear();
+    for (auto f : fragments) {
+        double x = f / bin_width;
+        signature.add_bin((int64_t)std::floor(x - 0.5));
+        signature.add_bin((int64_t)std::floor(x + 0.5));
+    }
+}
+
+void Protein::build_signatures(double bin_width, bool gluc_digest)
+{
+    this->signatures.clear();
+    if (!this->indexed()) return;
+
+    std::vector<double> fragments;
+    this->signatures.resize(this->digest_count(gluc_digest));
+    for (int digest = 0; digest < (int)this->signatures.size(); digest++) {
+        int begin, end;
+        this->digest_range(gluc_digest, digest, begin, end);
+        fragments.clear();
+        fragment_sequence(*this, begin, end, fragments);
+        add_fragment_bins(fragments, bin_width, this->signatures[digest]);
+    }
+}
+
+const MassSignature &Protein::signature(int digest) const
+{
+    return this->signatures[digest];
+}
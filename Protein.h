@@ -1,20 +1,99 @@
 #ifndef PROTEIN_H
 #define PROTEIN_H
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
+// Coarse fragment-mass fingerprint: a 256-bit Bloom-style set of mass bins.
+// Used to reject peptides with a few word operations before the exact fragment check.
+class MassSignature
+{
+public:
+    uint64_t bits[4];
+
+public:
+    void clear();
+    void add_bin(int64_t bin);
+    bool has_bin(int64_t bin) const;
+
+    // True if every bit set in query is also set here
+    bool contains(const MassSignature &query) const;
+
+    // True if so many bits are set (long peptides, or whole proteins without a digest) that
+    // contains() would accept nearly every query; the prefilter skips these signatures
+    bool saturated() const;
+};
+
 class Protein
 {
 
 public:
-    std::string source_database;
-    std::string description;
+    // The FASTA header (without the '>') stays in the database file, at [description_offset,
+    // description_offset + description_length); DescriptionReader fetches it when needed
+    uint16_t database_id;               // Interned database file, see database_path()
+    uint32_t description_length;
+    uint64_t description_offset;
+    std::string accession;              // Parsed from the header, see parse_accession()
     std::vector<char> sequence;
-    std::vector<std::vector<char>> digested_sequences;
+
+    // Precomputed by build_index() at load time; left empty if the sequence is not valid.
+    // Residue masses are not kept (they would take 8 bytes per residue); the search sums them per digest.
+    std::vector<int> digest_ends;       // Exclusive end offset of each GluC digest within sequence
+    std::vector<int> unknown_residues;  // Positions with no known residue mass (digests containing one are skipped)
+
+    // Mass-bin prefilter signatures, one per digest of the digest mode they were built for (only that
+    // mode's; see Database::signature_gluc). Built at load time or taken from the index.
+    std::vector<MassSignature> signatures;
 
 public:
+    Protein();
+
     bool sequence_valid() const;
+
+    // Find the GluC digest boundaries and the residues without a known mass
+    void build_index();
+
+    // False if build_index() rejected the sequence; it is then never searched
+    bool indexed() const;
+
+    // Digest boundaries [begin, end) for the given digest mode
+    int digest_count(bool gluc_digest) const;
+    void digest_range(bool gluc_digest, int digest, int &begin, int &end) const;
+
+    // True if every residue in [begin, end) has a known mass
+    bool range_has_masses(int begin, int end) const;
+
+    // Compute the prefilter signatures of one digest mode from the fragment masses
+    void build_signatures(double bin_width, bool gluc_digest);
+    const MassSignature &signature(int digest) const;
 };
 
+// Accession of a FASTA header: the second field of UniProt-style "db|ACCESSION|name ..." headers,
+// otherwise the first word
+std::string parse_accession(const char *header, size_t length);
+
+// Monoisotopic residue mass; throws std::invalid_argument for unknown amino acids
+double get_amino_acid_mass(char aa);
+
+// Water as the Y ion formula adds it (once per residue, see fragment_sequence())
+const double water_mass = 18.01088;
+
+// Monoisotopic mass of water, added once to the residues for the intact peptide (precursor) mass
+const double peptide_water_mass = 18.010565;
+
+// Total residue mass of residues [begin, end) of a protein (unknown residues count as 0)
+double residue_mass_sum(const Protein &protein, int begin, int end);
+
+// Append the B and Y ion masses of residues [begin, end) of an indexed protein
+void fragment_sequence(const Protein &protein, int begin, int end, std::vector<double> &fragment_list);
+
+// Decoy peptides for FDR estimation, fragmented straight from the target's residues without building a
+// decoy sequence. Both keep the C-terminal residue in place, so the decoy ends in the same cleavage site.
+// Reversed: residues [begin, end - 1) in reverse order
+void reversed_decoy_fragments(const Protein &protein, int begin, int end, std::vector<double> &fragment_list);
+// Shuffled: residues [begin, end - 1) permuted by a generator seeded with seed (same seed, same decoy);
+// residue_masses is scratch space
+void shuffled_decoy_fragments(const Protein &protein, int begin, int end, uint64_t seed, std::vector<double> &residue_masses, std::vector<double> &fragment_list);
+
 #endif // PROTEIN_H
@@ -0,0 +1,416 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "ResultCache.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+#ifdef _MSC_VER
+#include <process.h>
+#include <windows.h>
+#define getpid() _getpid()
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+#include "FragmentSearch.h"
+#include "Hash.h"
+
+static const char cache_magic[] = "FSCACHE 2";
+
+// Exclusive lock on the cache directory, held while the index is read, updated and rewritten (and while
+// an entry is being copied out, so no other run evicts it halfway). Blocks until the lock is free.
+class cache_lock
+{
+public:
+    cache_lock(const std::string &path)
+    {
+#ifdef _MSC_VER
+        this->handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        OVERLAPPED overlapped = {};
+        this->locked = this->handle != INVALID_HANDLE_VALUE && LockFileEx(this->handle, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped);
+#else
+        this->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        this->locked = this->fd >= 0 && flock(this->fd, LOCK_EX) == 0;
+#endif
+        if (!this->locked) fprintf(stderr, "Unable to lock result cache index '%s'.\n", path.c_str());
+    }
+
+    ~cache_lock()
+    {
+#ifdef _MSC_VER
+        if (this->handle != INVALID_HANDLE_VALUE) CloseHandle(this->handle);
+#else
+        if (this->fd >= 0) close(this->fd);
+#endif
+    }
+
+    bool locked;
+
+private:
+#ifdef _MSC_VER
+    HANDLE handle;
+#else
+    int fd;
+#endif
+};
+
+static std::string to_hex(uint64_t value)
+{
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016" PRIx64, value);
+    return std::string(buffer);
+}
+
+// Read a line (without the trailing newline); returns false at end of file
+static bool read_line(FILE *fp, std::string &line)
+{
+    line.clear();
+    int c;
+    while ((c = fgetc(fp)) != EOF) {
+        if (c == '\n') return true;
+        line.push_back((char)c);
+    }
+    return !line.empty();
+}
+
+bool fingerprint_file(const std::string &path, uint64_t &fingerprint)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) return false;
+
+    std::vector<char> buffer(1 << 20);
+    uint64_t hash = fnv_offset_basis;
+    size_t n_read;
+    while ((n_read = fread(buffer.data(), 1, buffer.size(), fp)) > 0) {
+        hash = fnv1a(buffer.data(), n_read, hash);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+    fingerprint = hash;
+    return ok;
+}
+
+ResultCache::ResultCache(const Configuration &config)
+{
+    this->n_hits = 0;
+    this->n_misses = 0;
+    this->directory = config.result_cache_directory;
+    this->max_bytes = (uint64_t)(config.result_cache_max_mb * 1024 * 1024);
+    if (this->directory.empty()) return;
+
+    std::vector<uint64_t> fingerprints;
+    if (!this->fingerprint_databases(config.databases, fingerprints)) {
+        // Leave the cache disabled; the search itself will report the unreadable file
+        this->directory.clear();
+        return;
+    }
+
+    // Canonical form of the query: every database (path and content fingerprint, in search order),
+    // then the search parameters. Target masses are order-independent, so sort them.
+    std::stringstream canonical;
+    for (size_t i = 0; i < config.databases.size(); i++) {
+        canonical << "db=" << config.databases[i] << "@" << to_hex(fingerprints[i]) << ";";
+    }
+    std::vector<double> masses = config.target_masses;
+    std::sort(masses.begin(), masses.end());
+    char buffer[64];
+    canonical << "masses=";
+    for (auto mass : masses) {
+        snprintf(buffer, sizeof(buffer), "%.6f,", mass);
+        canonical << buffer;
+    }
+    snprintf(buffer, sizeof(buffer), ";tolerance=%.6f", config.mass_tolerance);
+    canonical << buffer;
+    canonical << ";gluc_digest=" << (config.gluc_digest ? 1 : 0);
+    if (config.precursor_mass > 0) {
+        snprintf(buffer, sizeof(buffer), ";precursor=%.6f,%.6f", config.precursor_mass, config.precursor_tolerance);
+        canonical << buffer;
+    }
+    canonical << ";decoy_mode=" << (int)config.decoy_mode;
+    if (config.partial_scoring) {
+        // Intensities pair up with the masses, so keep them in the configured order
+        canonical << ";partial_scoring=" << config.top_k << "," << config.min_matched_targets << ";order=";
+        for (auto mass : config.target_masses) {
+            snprintf(buffer, sizeof(buffer), "%.6f,", mass);
+            canonical << buffer;
+        }
+        canonical << ";intensities=";
+        for (auto intensity : config.target_intensities) {
+            snprintf(buffer, sizeof(buffer), "%.6g,", intensity);
+            canonical << buffer;
+        }
+    }
+
+    this->canonical_key = canonical.str();
+    this->key = to_hex(fnv1a(this->canonical_key.data(), this->canonical_key.size()));
+}
+
+bool ResultCache::enabled() const
+{
+    return !this->directory.empty();
+}
+
+std::string ResultCache::entry_path(const std::string &entry_key) const
+{
+    return this->directory + "/" + entry_key + ".fsr";
+}
+
+std::string ResultCache::index_path() const
+{
+    return this->directory + "/cache_index.txt";
+}
+
+std::string ResultCache::lock_path() const
+{
+    return this->directory + "/cache_index.lock";
+}
+
+// Temporary file next to path, unique to this process
+static std::string temp_file_path(const std::string &path)
+{
+    return path + "." + std::to_string((long long)getpid()) + ".tmp";
+}
+
+std::string ResultCache::fingerprints_path() const
+{
+    return this->directory + "/cache_fingerprints.txt";
+}
+
+// Content fingerprint of each database. The fingerprints file remembers the last one of each path, as
+// "size mtime fingerprint path" lines; a file is only hashed again when its size or mtime changed.
+bool ResultCache::fingerprint_databases(const std::vector<std::string> &paths, std::vector<uint64_t> &fingerprints) const
+{
+    struct stored_fingerprint {
+        unsigned long long size;
+        long long modified_time;
+        uint64_t fingerprint;
+    };
+
+    cache_lock lock(this->lock_path());
+    std::unordered_map<std::string, stored_fingerprint> stored;
+    FILE *fp = fopen(this->fingerprints_path().c_str(), "r");
+    if (fp) {
+        std::string line;
+        while (read_line(fp, line)) {
+            stored_fingerprint entry;
+            unsigned long long fingerprint;
+            int path_start = 0;
+            if (sscanf(line.c_str(), "%llu %lld %llx %n", &entry.size, &entry.modified_time, &fingerprint, &path_start) != 3 || path_start == 0) continue;
+            entry.fingerprint = fingerprint;
+            stored[line.substr(path_start)] = entry;
+        }
+        fclose(fp);
+    }
+
+    bool changed = false;
+    time_t now = time(nullptr);
+    fingerprints.clear();
+    for (const auto &path : paths) {
+        struct stat file_stat;
+        if (stat(path.c_str(), &file_stat) != 0) return false;
+        auto it = stored.find(path);
+        if (it != stored.end() && it->second.size == (unsigned long long)file_stat.st_size && it->second.modified_time == (long long)file_stat.st_mtime) {
+            fingerprints.push_back(it->second.fingerprint);
+            continue;
+        }
+
+        uint64_t fingerprint;
+        if (!fingerprint_file(path, fingerprint)) return false;
+        fingerprints.push_back(fingerprint);
+        // A file modified within the current second could change again without its mtime moving on,
+        // so only remember it once that second has passed
+        if (file_stat.st_mtime < now) {
+            stored[path] = stored_fingerprint{ (unsigned long long)file_stat.st_size, (long long)file_stat.st_mtime, fingerprint };
+            changed = true;
+        }
+    }
+    if (!changed || !lock.locked) return true;
+
+    // Not being able to save them only means hashing the files again next time
+    std::string temp_path = temp_file_path(this->fingerprints_path());
+    fp = fopen(temp_path.c_str(), "w");
+    if (!fp) return true;
+    bool ok = true;
+    for (const auto &entry : stored) {
+        ok = ok && fprintf(fp, "%llu %lld %s %s\n", entry.second.size, entry.second.modified_time, to_hex(entry.second.fingerprint).c_str(), entry.first.c_str()) > 0;
+    }
+    ok = !ferror(fp) && ok;
+    ok = fclose(fp) == 0 && ok;
+    if (ok) {
+        remove(this->fingerprints_path().c_str());
+        ok = rename(temp_path.c_str(), this->fingerprints_path().c_str()) == 0;
+    }
+    if (!ok) remove(temp_path.c_str());
+    return true;
+}
+
+bool ResultCache::read_index(std::vector<IndexEntry> &entries, uint64_t &clock) const
+{
+    entries.clear();
+    clock = 0;
+    FILE *fp = fopen(this->index_path().c_str(), "r");
+    if (!fp) return false;
+
+    std::string line;
+    if (read_line(fp, line)) {
+        clock = strtoull(line.c_str(), nullptr, 10);
+    }
+    while (read_line(fp, line)) {
+        char entry_key[64];
+        unsigned long long size, last_used;
+        if (sscanf(line.c_str(), "%63s %llu %llu", entry_key, &size, &last_used) != 3) continue;
+        IndexEntry entry;
+        entry.key = entry_key;
+        entry.size = size;
+        entry.last_used = last_used;
+        entries.push_back(entry);
+    }
+    fclose(fp);
+    return true;
+}
+
+bool ResultCache::write_index(const std::vector<IndexEntry> &entries, uint64_t clock) const
+{
+    std::string temp_path = temp_file_path(this->index_path());
+    FILE *fp = fopen(temp_path.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "Unable to update result cache index in '%s'.\n", this->directory.c_str());
+        return false;
+    }
+    bool ok = fprintf(fp, "%llu\n", (unsigned long long)clock) > 0;
+    for (const auto &entry : entries) {
+        ok = ok && fprintf(fp, "%s %llu %llu\n", entry.key.c_str(), (unsigned long long)entry.size, (unsigned long long)entry.last_used) > 0;
+    }
+    ok = !ferror(fp) && ok;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Unable to update result cache index in '%s'.\n", this->directory.c_str());
+        remove(temp_path.c_str());
+        return false;
+    }
+    remove(this->index_path().c_str());
+    return rename(temp_path.c_str(), this->index_path().c_str()) == 0;
+}
+
+// Mark this entry as most recently used, then evict from the least recently used end until under the size cap.
+// Call with the cache lock held. Returns false if the index couldn't be updated.
+bool ResultCache::touch(uint64_t entry_size)
+{
+    std::vector<IndexEntry> entries;
+    uint64_t clock;
+    this->read_index(entries, clock);
+    ++clock;
+
+    auto it = std::find_if(entries.begin(), entries.end(), [&](const IndexEntry &e) { return e.key == this->key; });
+    if (it == entries.end()) {
+        IndexEntry entry;
+        entry.key = this->key;
+        entry.size = entry_size;
+        entries.push_back(entry);
+        it = entries.end() - 1;
+    }
+    it->last_used = clock;
+    if (entry_size) it->size = entry_size;
+
+    std::sort(entries.begin(), entries.end(), [](const IndexEntry &a, const IndexEntry &b) { return a.last_used > b.last_used; });
+    uint64_t total_size = 0;
+    size_t n_kept = 0;
+    for (; n_kept < entries.size(); n_kept++) {
+        // Always keep the most recent entry, even if it alone exceeds the cap
+        if (n_kept > 0 && total_size + entries[n_kept].size > this->max_bytes) break;
+        total_size += entries[n_kept].size;
+    }
+    for (size_t i = n_kept; i < entries.size(); i++) {
+        remove(this->entry_path(entries[i].key).c_str());
+    }
+    entries.resize(n_kept);
+
+    return this->write_index(entries, clock);
+}
+
+bool ResultCache::lookup(Results &results, FILE *output_file)
+{
+    if (!this->enabled()) return false;
+
+    cache_lock lock(this->lock_path());
+    FILE *fp = fopen(this->entry_path(this->key).c_str(), "rb");
+    if (!fp) {
+        ++this->n_misses;
+        return false;
+    }
+
+    // Verify the header: guards against hash collisions and truncated entries
+    std::string line;
+    Results cached;
+    bool valid = read_line(fp, line) && line == cache_magic;
+    valid = valid && read_line(fp, line) && line == this->canonical_key;
+    valid = valid && read_line(fp, line) &&
+        sscanf(line.c_str(), "%d %d %d %d %d", &cached.n_searched_sequences, &cached.n_skipped_sequences, &cached.n_matched_sequences, &cached.n_digest_sequences,
+            &cached.n_decoy_matches) == 5;
+
+    // Read the whole body before writing any of it, so a failed read is still a clean miss
+    std::vector<char> body;
+    std::vector<char> buffer(1 << 16);
+    size_t n_read;
+    while (valid && (n_read = fread(buffer.data(), 1, buffer.size(), fp)) > 0) {
+        body.insert(body.end(), buffer.begin(), buffer.begin() + n_read);
+    }
+    valid = valid && !ferror(fp);
+    fclose(fp);
+    if (!valid) {
+        ++this->n_misses;
+        return false;
+    }
+
+    if (!body.empty() && fwrite(body.data(), 1, body.size(), output_file) != body.size()) {
+        throw std::runtime_error("Unable to write the cached results to the output file.");
+    }
+
+    results = std::move(cached);
+    ++this->n_hits;
+    this->touch(0);
+    return true;
+}
+
+void ResultCache::store(const Configuration &config, const Results &results)
+{
+    if (!this->enabled()) return;
+
+    // Write to a temporary file first so a concurrent reader never sees a partial entry
+    std::string path = this->entry_path(this->key);
+    std::string temp_path = temp_file_path(path);
+    FILE *fp = fopen(temp_path.c_str(), "wb");
+    if (!fp) {
+        fprintf(stderr, "Unable to write result cache entry in '%s'.\n", this->directory.c_str());
+        return;
+    }
+    fprintf(fp, "%s\n%s\n", cache_magic, this->canonical_key.c_str());
+    fprintf(fp, "%d %d %d %d %d\n", results.n_searched_sequences, results.n_skipped_sequences, results.n_matched_sequences, results.n_digest_sequences,
+        results.n_decoy_matches);
+    write_results(config, results, fp);
+    long entry_size = ftell(fp);
+    bool ok = !ferror(fp);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok) {
+        fprintf(stderr, "Unable to write result cache entry in '%s'.\n", this->directory.c_str());
+        remove(temp_path.c_str());
+        return;
+    }
+
+    // An entry the index doesn't know about could never be evicted, so drop it if the index can't be updated
+    cache_lock lock(this->lock_path());
+    remove(path.c_str());
+    if (rename(temp_path.c_str(), path.c_str()) != 0 || !this->touch(entry_size > 0 ? (uint64_t)entry_size : 1)) {
+        remove(temp_path.c_str());
+        remove(path.c_str());
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Configuration.h"
+#include "Results.h"
+
+// Content-addressed on-disk cache of search output.
+// Entries are keyed on a fingerprint of every database file plus the canonicalized
+// search parameters, and are evicted least-recently-used once the size cap is exceeded.
+class ResultCache
+{
+public:
+    int n_hits;
+    int n_misses;
+
+public:
+    // Constructor: fingerprints the configured databases (no-op if the cache is disabled). Files whose
+    // size and modification time match the fingerprint stored in the cache directory aren't read again.
+    ResultCache(const Configuration &config);
+
+    bool enabled() const;
+
+    // On a hit, copies the cached output to output_file, fills in the result counters and returns true
+    bool lookup(Results &results, FILE *output_file);
+
+    // Store the output of a completed search
+    void store(const Configuration &config, const Results &results);
+
+private:
+    struct IndexEntry {
+        std::string key;
+        uint64_t size;
+        uint64_t last_used;
+    };
+
+    std::string directory;
+    uint64_t max_bytes;
+    std::string canonical_key;
+    std::string key;
+
+    std::string entry_path(const std::string &entry_key) const;
+    std::string index_path() const;
+    std::string lock_path() const;
+    std::string fingerprints_path() const;
+    bool fingerprint_databases(const std::vector<std::string> &paths, std::vector<uint64_t> &fingerprints) const;
+    bool read_index(std::vector<IndexEntry> &entries, uint64_t &clock) const;
+    bool write_index(const std::vector<IndexEntry> &entries, uint64_t clock) const;
+    bool touch(uint64_t entry_size);
+};
+
+// FNV-1a hash over the contents of a file; returns false if it cannot be read
+bool fingerprint_file(const std::string &path, uint64_t &fingerprint);
+
+#endif // RESULT_CACHE_H
@@ -6,6 +6,10 @@ Results::Results()
     this->n_matched_sequences = 0;
     this->n_skipped_sequences = 0;
     this->n_digest_sequences = 0;
+    this->n_prefiltered_digests = 0;
+    this->n_saturated_digests = 0;
+    this->n_decoy_matches = 0;
+    this->cancelled = false;
 }
 
 Results Results::Combine(std::vector<Results> results)
@@ -16,11 +20,16 @@ Results Results::Combine(std::vector<Results> results)
         final_result.n_searched_sequences += result.n_searched_sequences;
         final_result.n_skipped_sequences += result.n_skipped_sequences;
         final_result.n_digest_sequences += result.n_digest_sequences;
+        final_result.n_prefiltered_digests += result.n_prefiltered_digests;
+        final_result.n_saturated_digests += result.n_saturated_digests;
+        final_result.n_decoy_matches += result.n_decoy_matches;
+        final_result.cancelled = final_result.cancelled || result.cancelled;
         final_result.matches.insert(final_result.matches.end(), result.matches.begin(), result.matches.end());
 
         final_result.searched_sequence_lengths.insert(final_result.searched_sequence_lengths.end(), result.searched_sequence_lengths.begin(), result.searched_sequence_lengths.end());
         final_result.searched_digest_lengths.insert(final_result.searched_digest_lengths.end(), result.searched_digest_lengths.begin(), result.searched_digest_lengths.end());
         final_result.digests_per_sequence.insert(final_result.digests_per_sequence.end(), result.digests_per_sequence.begin(), result.digests_per_sequence.end());
+        final_result.top_matches.insert(final_result.top_matches.end(), result.top_matches.begin(), result.top_matches.end());
     }
     return final_result;
 }
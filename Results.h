@@ -1,10 +1,22 @@
 #ifndef RESULTS_H
 #define RESULTS_H
 
+#include <string>
 #include <vector>
 
 #include "Protein.h"
 
+// A single scored peptide from a partial-match search
+class PeptideMatch
+{
+public:
+    double score;
+    int n_matched_targets;
+    std::string source_database;
+    std::string description;
+    std::string peptide;
+};
+
 class Results
 {
 public:
@@ -12,11 +24,18 @@ public:
     int n_skipped_sequences;
     int n_matched_sequences;
     int n_digest_sequences;
+    int n_prefiltered_digests;
+    int n_saturated_digests;    // Digests the prefilter couldn't check (signature saturated)
+    int n_decoy_matches;    // Decoy digests that would have matched (n_matched_sequences counts the targets)
+    bool cancelled;     // The search was stopped before every sequence was searched
     std::vector<Protein> matches;
     std::vector<int> searched_sequence_lengths;
     std::vector<std::vector<int>> searched_digest_lengths;
     std::vector<int> digests_per_sequence;
 
+    // Partial scoring mode: the best-scoring peptides, best first
+    std::vector<PeptideMatch> top_matches;
+
 public:
     Results();
 
@@ -0,0 +1,811 @@
+#include "SearchEngine.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <stdexcept>
+
+#include "FragmentSearch.h"
+#include "Hash.h"
+#include "Numa.h"
+
+// Implementation file for the search itself: scoring, the worker threads and the library interface
+
+
+SearchQuery::SearchQuery()
+{
+    this->mass_tolerance = 0;
+    this->gluc_digest = true;
+    this->precursor_mass = 0;
+    this->precursor_tolerance = 0;
+    this->partial_scoring = false;
+    this->top_k = 10;
+    this->min_matched_targets = 1;
+    this->decoy_mode = DecoyMode::None;
+    this->time_budget_seconds = 0;
+    this->residue_budget = 0;
+    this->mass_prefilter = true;
+    this->collect_length_statistics = false;
+}
+
+SearchQuery SearchQuery::FromConfiguration(const Configuration &config)
+{
+    SearchQuery query;
+    query.target_masses = config.target_masses;
+    query.mass_tolerance = config.mass_tolerance;
+    query.gluc_digest = config.gluc_digest;
+    query.precursor_mass = config.precursor_mass;
+    query.precursor_tolerance = config.precursor_tolerance;
+    query.partial_scoring = config.partial_scoring;
+    query.top_k = config.top_k;
+    query.min_matched_targets = config.min_matched_targets;
+    query.target_intensities = config.target_intensities;
+    query.decoy_mode = config.decoy_mode;
+    query.time_budget_seconds = config.time_budget_seconds;
+    query.residue_budget = config.residue_budget;
+    query.mass_prefilter = config.mass_prefilter;
+    query.collect_length_statistics = true;
+    return query;
+}
+
+std::shared_ptr<const DatabaseSet> DatabaseSet::Load(const Configuration &config)
+{
+    auto database_set = std::make_shared<DatabaseSet>();
+    database_set->databases = read_databases(config);
+    return database_set;
+}
+
+CancellationToken::CancellationToken() : flag(false)
+{
+}
+
+void CancellationToken::cancel()
+{
+    this->flag.store(true, std::memory_order_relaxed);
+}
+
+bool CancellationToken::cancelled() const
+{
+    return this->flag.load(std::memory_order_relaxed);
+}
+
+SearchProgress::SearchProgress() : n_sequences(0), n_residues(0), total_sequences(0), total_residues(0)
+{
+}
+
+WorkerThreadPool::WorkerThreadPool(int n_threads, ThreadAffinity affinity)
+{
+    // If unspecified, query how many hardware threads we can use at once
+    if (n_threads == 0) {
+        n_threads = std::thread::hardware_concurrency();
+    }
+    // In case hardware_concurrency() isn't supported, default to single-threaded
+    if (n_threads == 0) n_threads = 1;
+
+    this->affinity = affinity;
+    this->job = nullptr;
+    this->n_idle = 0;
+    this->generation = 0;
+    this->stopping = false;
+
+    // Decide which node each worker belongs to (workers only get pinned if an affinity was requested)
+    const NumaTopology &topology = NumaTopology::Get();
+    std::vector<std::vector<int>> worker_cpus(n_threads);
+    for (int i = 0; i < n_threads; i++) {
+        int node = 0;
+        if (affinity == ThreadAffinity::Cores) {
+            worker_cpus[i].push_back(topology.cpu_for_worker(i, node));
+        } else if (affinity == ThreadAffinity::Numa) {
+            node = i % topology.node_count();
+            worker_cpus[i] = topology.node_cpus[node];
+        }
+        this->worker_nodes.push_back(node);
+    }
+
+    this->workers.reserve(n_threads);
+    for (int i = 0; i < n_threads; i++) {
+        std::vector<int> cpus = worker_cpus[i];
+        this->workers.push_back(std::thread([this, i, cpus]() {
+            if (!cpus.empty() && !pin_current_thread(cpus)) warn_pinning_failed();
+            this->worker_loop(i);
+        }));
+    }
+}
+
+WorkerThreadPool::~WorkerThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->work_ready.notify_all();
+    for (auto &worker : this->workers) {
+        worker.join();
+    }
+}
+
+int WorkerThreadPool::size() const
+{
+    return (int)this->workers.size();
+}
+
+void WorkerThreadPool::run_on_workers(const std::function<void(int)> &job)
+{
+    // One batch at a time; concurrent searches sharing a pool take turns
+    std::lock_guard<std::mutex> run_lock(this->run_mutex);
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->job = &job;
+    this->n_idle = 0;
+    ++this->generation;
+    this->work_ready.notify_all();
+
+    // Every worker reports in once it has finished its part of this generation
+    this->work_done.wait(lock, [this]() { return this->n_idle == this->workers.size(); });
+    this->job = nullptr;
+}
+
+void WorkerThreadPool::worker_loop(int worker)
+{
+    uint64_t seen_generation = 0;
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for (;;) {
+        this->work_ready.wait(lock, [&]() { return this->stopping || this->generation != seen_generation; });
+        if (this->stopping) return;
+        seen_generation = this->generation;
+        const std::function<void(int)> &job = *this->job;
+        lock.unlock();
+
+        job(worker);
+
+        lock.lock();
+        if (++this->n_idle == this->workers.size()) this->work_done.notify_all();
+    }
+}
+
+void WorkerThreadPool::run(int n_tasks, const std::function<void(int)> &task)
+{
+    std::atomic<int> next_task(0);
+    this->run_on_workers([&](int) {
+        int i;
+        while ((i = next_task++) < n_tasks) {
+            task(i);
+        }
+    });
+}
+
+void WorkerThreadPool::run_placed(int n_tasks, const std::function<void(int)> &task, const std::vector<int> &task_nodes)
+{
+    if (this->affinity == ThreadAffinity::None) {
+        this->run(n_tasks, task);
+        return;
+    }
+
+    // Queue the tasks by node
+    int n_nodes = NumaTopology::Get().node_count();
+    std::vector<std::vector<int>> node_tasks(n_nodes);
+    for (int i = 0; i < n_tasks; i++) {
+        int node = i < (int)task_nodes.size() ? task_nodes[i] : 0;
+        node_tasks[node >= 0 && node < n_nodes ? node : 0].push_back(i);
+    }
+    std::unique_ptr<std::atomic<int>[]> next_task(new std::atomic<int>[n_nodes]);
+    for (int node = 0; node < n_nodes; node++) {
+        next_task[node] = 0;
+    }
+
+    this->run_on_workers([&](int worker) {
+        // Own node first, then the others in turn
+        for (int offset = 0; offset < n_nodes; offset++) {
+            int node = (this->worker_nodes[worker] + offset) % n_nodes;
+            int i;
+            while ((i = next_task[node]++) < (int)node_tasks[node].size()) {
+                task(node_tasks[node][i]);
+            }
+        }
+    });
+}
+
+
+// Mass-bin prefilter for a query: a digest can only contain a target if the target's bin is set in its signature
+struct query_prefilter {
+    query_prefilter() : enabled(false) { signature.clear(); }
+
+    bool enabled;
+    MassSignature signature;            // Bins of all target masses
+    std::vector<int64_t> target_bins;   // Bin of each target mass
+};
+
+static query_prefilter build_query_prefilter(const SearchQuery &query, const Database &database)
+{
+    query_prefilter prefilter;
+    double bin_width = database.signature_bin_width;
+    // Peptide signatures cover +/- half a bin around each fragment, so wider tolerances can't use them.
+    // They only exist for one digest mode (see Database::build_signatures()).
+    if (!query.mass_prefilter || bin_width <= 0 || database.signature_gluc != query.gluc_digest || query.mass_tolerance > bin_width / 2) return prefilter;
+    prefilter.enabled = true;
+    for (auto mass : query.target_masses) {
+        int64_t bin = (int64_t)std::floor(mass / bin_width);
+        prefilter.target_bins.push_back(bin);
+        prefilter.signature.add_bin(bin);
+    }
+    return prefilter;
+}
+
+// Emits a match through the (serialized) user callback
+typedef std::function<void(const SearchMatch &match)> match_emitter;
+
+// Return true if all of the target masses are in the fragment list (false otherwise)
+static bool all_masses_found(const std::vector<double> &fragments, const std::vector<double> &mass_list, double tolerance)
+{
+    for (auto mass : mass_list) {
+        bool mass_found = false;
+        for (auto f : fragments) {
+            if (std::abs(mass - f) < tolerance) {
+                mass_found = true;
+                break;
+            }
+        }
+        if (!mass_found) return false;
+    }
+    return true;
+}
+
+// The (weighted) number of target masses among the fragments
+static void score_fragments(const std::vector<double> &fragments, const std::vector<double> &mass_list, const std::vector<double> &weights, double tolerance,
+    double &score, int &n_matched)
+{
+    score = 0;
+    n_matched = 0;
+    for (size_t t = 0; t < mass_list.size(); t++) {
+        for (auto f : fragments) {
+            if (std::abs(mass_list[t] - f) < tolerance) {
+                score += weights.empty() ? 1.0 : weights[t];
+                ++n_matched;
+                break;
+            }
+        }
+    }
+}
+
+// Partial scoring: a candidate peptide, referenced by position so the per-thread heaps stay small
+struct scored_peptide {
+    double score;
+    int n_matched;
+    int database_index;
+    int sequence_index;
+    int begin;
+    int end;
+};
+
+// Ranking: higher score first, ties go to whichever comes first in the databases (so results don't depend on threading)
+static bool better_peptide(const scored_peptide &a, const scored_peptide &b)
+{
+    if (a.score != b.score) return a.score > b.score;
+    if (a.database_index != b.database_index) return a.database_index < b.database_index;
+    if (a.sequence_index != b.sequence_index) return a.sequence_index < b.sequence_index;
+    return a.begin < b.begin;
+}
+
+// Add a peptide to a bounded heap holding the top_k best seen so far (the worst of them at the front).
+// The heap only grows as peptides arrive, so a large top_k costs nothing unless that many match.
+static void offer_peptide(std::vector<scored_peptide> &heap, int top_k, const scored_peptide &peptide)
+{
+    if ((int)heap.size() < top_k) {
+        heap.push_back(peptide);
+        std::push_heap(heap.begin(), heap.end(), better_peptide);
+    } else if (better_peptide(peptide, heap.front())) {
+        std::pop_heap(heap.begin(), heap.end(), better_peptide);
+        heap.back() = peptide;
+        std::push_heap(heap.begin(), heap.end(), better_peptide);
+    }
+}
+
+// What the digest searches of one task share: the query and its prefilter, where matches go, the task's
+// counters and scratch space for fragment masses
+struct task_context {
+    task_context(const SearchQuery &query, const query_prefilter &prefilter, const match_emitter &emit, std::vector<scored_peptide> &heap, Results &result) :
+        query(query), prefilter(prefilter), emit(emit), heap(heap), result(result)
+    {
+    }
+
+    const SearchQuery &query;
+    const query_prefilter &prefilter;
+    const match_emitter &emit;              // Exact search
+    std::vector<scored_peptide> &heap;      // Partial scoring: the task's top_k heap
+    Results &result;                        // Prefilter and decoy counters
+    std::vector<double> fragments;
+    std::vector<double> scratch;
+};
+
+// Fragment the decoy of a digest. Shuffles are seeded by the digest's position, so they don't depend on the threading.
+// The target's prefilter signature says nothing about its decoy, so decoys are always fragmented.
+static void decoy_fragments(task_context &context, const Protein &protein, int database_index, int sequence_index, int begin, int end)
+{
+    context.fragments.clear();
+    if (context.query.decoy_mode == DecoyMode::Reverse) {
+        reversed_decoy_fragments(protein, begin, end, context.fragments);
+    } else {
+        int position[3] = { database_index, sequence_index, begin };
+        shuffled_decoy_fragments(protein, begin, end, fnv1a(position, sizeof(position)), context.scratch, context.fragments);
+    }
+}
+
+// Exact search of one digest (and its decoy); emits the match and returns true if every target matched
+static bool search_digest(task_context &context, const Protein &protein, int digest, SearchMatch &match)
+{
+    const SearchQuery &query = context.query;
+    int begin, end;
+    protein.digest_range(query.gluc_digest, digest, begin, end);
+
+    // FASTA format supports X for unknown, B/Z for ambiguous, etc. Just skip those...
+    if (!protein.range_has_masses(begin, end)) return false;
+
+    // An empty digest (a trailing E) has no decoy
+    if (query.decoy_mode != DecoyMode::None && end > begin) {
+        decoy_fragments(context, protein, match.database_index, match.sequence_index, begin, end);
+        if (all_masses_found(context.fragments, query.target_masses, query.mass_tolerance)) ++context.result.n_decoy_matches;
+    }
+
+    // Cheap rejection: some target's mass bin isn't present among this digest's fragments
+    if (context.prefilter.enabled) {
+        const MassSignature &signature = protein.signature(digest);
+        if (signature.saturated()) {
+            ++context.result.n_saturated_digests;
+        } else if (!signature.contains(context.prefilter.signature)) {
+            ++context.result.n_prefiltered_digests;
+            return false;
+        }
+    }
+
+    context.fragments.clear();
+    fragment_sequence(protein, begin, end, context.fragments);
+
+    if (!all_masses_found(context.fragments, query.target_masses, query.mass_tolerance)) return false;
+    match.begin = begin;
+    match.end = end;
+    context.emit(match);
+    return true;
+}
+
+int search_sequence(task_context &context, const Protein &protein, SearchMatch &match)
+{
+    int match_count = 0;
+    int n_digests = protein.digest_count(context.query.gluc_digest);
+    for (int digest = 0; digest < n_digests; digest++) {
+        if (search_digest(context, protein, digest, match)) ++match_count;
+    }
+    return match_count;
+}
+
+// Partial scoring of one digest (and its decoy) by the (weighted) number of target masses among its fragments.
+// Returns true if it matched at least min_matched_targets; it is then offered to the heap.
+static bool score_digest(task_context &context, const Protein &protein, int digest, scored_peptide &candidate)
+{
+    const SearchQuery &query = context.query;
+    protein.digest_range(query.gluc_digest, digest, candidate.begin, candidate.end);
+    if (!protein.range_has_masses(candidate.begin, candidate.end)) return false;
+
+    if (query.decoy_mode != DecoyMode::None && candidate.end > candidate.begin) {
+        decoy_fragments(context, protein, candidate.database_index, candidate.sequence_index, candidate.begin, candidate.end);
+        score_fragments(context.fragments, query.target_masses, query.target_intensities, query.mass_tolerance, candidate.score, candidate.n_matched);
+        if (candidate.n_matched >= query.min_matched_targets) ++context.result.n_decoy_matches;
+    }
+
+    // The number of target bins present bounds how many targets can match
+    if (context.prefilter.enabled && protein.signature(digest).saturated()) {
+        ++context.result.n_saturated_digests;
+    } else if (context.prefilter.enabled) {
+        const MassSignature &signature = protein.signature(digest);
+        int n_possible = 0;
+        for (auto bin : context.prefilter.target_bins) {
+            if (signature.has_bin(bin)) ++n_possible;
+        }
+        if (n_possible < query.min_matched_targets) {
+            ++context.result.n_prefiltered_digests;
+            return false;
+        }
+    }
+
+    context.fragments.clear();
+    fragment_sequence(protein, candidate.begin, candidate.end, context.fragments);
+
+    score_fragments(context.fragments, query.target_masses, query.target_intensities, query.mass_tolerance, candidate.score, candidate.n_matched);
+    if (candidate.n_matched < query.min_matched_targets) return false;
+    offer_peptide(context.heap, query.top_k, candidate);
+    return true;
+}
+
+// Score every digest of a sequence. Returns the number of digests matching at least min_matched_targets.
+int score_sequence(task_context &context, const Protein &protein, scored_peptide &candidate)
+{
+    int match_count = 0;
+    int n_digests = protein.digest_count(context.query.gluc_digest);
+    for (int digest = 0; digest < n_digests; digest++) {
+        if (score_digest(context, protein, digest, candidate)) ++match_count;
+    }
+    return match_count;
+}
+
+// Progress and budgets shared by every task of a search
+struct search_budget {
+    SearchProgress *progress;
+    bool has_deadline;
+    std::chrono::steady_clock::time_point deadline;
+    uint64_t max_residues;      // 0 = unlimited
+};
+
+// Largest budgets that are still enforced: a deadline must fit the clock's 64-bit tick count
+// (nanoseconds, so about 292 years), and the residue count a uint64_t (2^64)
+static const double max_time_budget_seconds = 1e9;
+static const double max_residue_budget = 18446744073709551616.0;
+
+// Workers publish their progress (and check the budgets) once per this many sequences
+static const int progress_batch_size = 64;
+
+// Argument struct for each thread
+struct helper_thread_args_struct {
+    helper_thread_args_struct(const Database &database, const SearchQuery &query, const query_prefilter &prefilter, const match_emitter &emit, const search_budget &budget) :
+        database(database), query(query), prefilter(prefilter), emit(emit), budget(budget)
+    {
+        start_index = -1;
+        stop_index = -1;
+        database_index = 0;
+        cancellation = nullptr;
+        batch_items = 0;
+        batch_residues = 0;
+        candidates = nullptr;
+        first_sequence = -1;
+        last_sequence = -1;
+    }
+
+    const Database &database;
+    const SearchQuery &query;
+    const query_prefilter &prefilter;
+    const match_emitter &emit;
+    const search_budget &budget;
+    const CancellationToken *cancellation;
+    int database_index;
+    int start_index;
+    int stop_index;
+    Results result;
+
+    // Sequences (or peptides) and residues finished since progress was last published
+    uint64_t batch_items;
+    uint64_t batch_residues;
+
+    // Precursor window mode: start_index and stop_index select from these peptides instead of the sequences
+    const std::vector<PeptideEntry> *candidates;
+    int first_sequence;     // First and last sequence with a scored candidate (-1 if none)
+    int last_sequence;
+
+    // Partial scoring mode
+    std::vector<scored_peptide> top_peptides;
+};
+
+
+// Add the task's finished batch to the shared progress; returns false once a budget is used up
+static bool publish_progress(helper_thread_args_struct *p_args)
+{
+    const search_budget &budget = p_args->budget;
+    budget.progress->n_sequences.fetch_add(p_args->batch_items, std::memory_order_relaxed);
+    uint64_t total_residues = budget.progress->n_residues.fetch_add(p_args->batch_residues, std::memory_order_relaxed) + p_args->batch_residues;
+    p_args->batch_items = 0;
+    p_args->batch_residues = 0;
+    if (budget.max_residues && total_residues >= budget.max_residues) return false;
+    if (budget.has_deadline && std::chrono::steady_clock::now() >= budget.deadline) return false;
+    return true;
+}
+
+// Checked by a task before each of its items (item i): false, with the task's result marked cancelled, once
+// the search was cancelled or a budget is used up. Budgets are checked whenever a batch is full, and before
+// the first one, so tasks still queued when a budget runs out don't start on it.
+static bool continue_task(helper_thread_args_struct *p_args, int i)
+{
+    bool stop = p_args->cancellation && p_args->cancellation->cancelled();
+    if (!stop && (p_args->batch_items == progress_batch_size || i == p_args->start_index)) stop = !publish_progress(p_args);
+    if (stop) p_args->result.cancelled = true;
+    return !stop;
+}
+
+// Helper thread to run calculations
+int SearchThreadProc(struct helper_thread_args_struct *p_args)
+{
+    const SearchQuery &query = p_args->query;
+    const std::vector<Protein> &sequences = p_args->database.sequences;
+    task_context context(query, p_args->prefilter, p_args->emit, p_args->top_peptides, p_args->result);
+    int n_sequences = p_args->stop_index - p_args->start_index + 1;
+    if (query.collect_length_statistics) {
+        p_args->result.searched_sequence_lengths.reserve(n_sequences);
+        p_args->result.searched_digest_lengths.reserve(n_sequences);
+        p_args->result.digests_per_sequence.reserve(n_sequences);
+    }
+
+    SearchMatch match;
+    match.database_index = p_args->database_index;
+    match.database = &p_args->database;
+    match.score = (double)query.target_masses.size();
+    match.n_matched_targets = (int)query.target_masses.size();
+    scored_peptide candidate;
+    candidate.database_index = p_args->database_index;
+
+    for (int i = p_args->start_index; i <= p_args->stop_index; i++) {
+        if (!continue_task(p_args, i)) break;
+        const Protein &protein = sequences[i];
+        // Sequences that failed validation at load time have no digests
+        if (protein.indexed()) {
+            p_args->result.n_searched_sequences++;
+            if (query.partial_scoring) {
+                candidate.sequence_index = i;
+                p_args->result.n_matched_sequences += score_sequence(context, protein, candidate);
+            } else {
+                match.sequence_index = i;
+                match.protein = &protein;
+                p_args->result.n_matched_sequences += search_sequence(context, protein, match);
+            }
+        } else {
+            p_args->result.n_skipped_sequences++;
+        }
+        ++p_args->batch_items;
+        p_args->batch_residues += protein.sequence.size();
+        int n_digests = protein.digest_count(query.gluc_digest);
+        p_args->result.n_digest_sequences += n_digests;
+        if (!query.collect_length_statistics) continue;
+        p_args->result.searched_sequence_lengths.push_back((int)protein.sequence.size());
+        p_args->result.digests_per_sequence.push_back(n_digests);
+        std::vector<int> digest_sizes;
+        digest_sizes.reserve(n_digests);
+        for (int digest = 0; digest < n_digests; digest++) {
+            int begin, end;
+            protein.digest_range(query.gluc_digest, digest, begin, end);
+            digest_sizes.push_back(end - begin);
+        }
+        p_args->result.searched_digest_lengths.push_back(std::move(digest_sizes));
+    }
+
+    publish_progress(p_args);
+
+    return 0;
+}
+
+// Helper thread for precursor window searches: fragment-match a range of candidate peptides
+int PrecursorThreadProc(struct helper_thread_args_struct *p_args)
+{
+    const SearchQuery &query = p_args->query;
+    const std::vector<Protein> &sequences = p_args->database.sequences;
+    const std::vector<PeptideEntry> &candidates = *p_args->candidates;
+    task_context context(query, p_args->prefilter, p_args->emit, p_args->top_peptides, p_args->result);
+
+    SearchMatch match;
+    match.database_index = p_args->database_index;
+    match.database = &p_args->database;
+    match.score = (double)query.target_masses.size();
+    match.n_matched_targets = (int)query.target_masses.size();
+    scored_peptide candidate;
+    candidate.database_index = p_args->database_index;
+
+    for (int i = p_args->start_index; i <= p_args->stop_index; i++) {
+        if (!continue_task(p_args, i)) break;
+        const PeptideEntry &entry = candidates[i];
+        const Protein &protein = sequences[entry.sequence_index];
+        if (entry.sequence_index != p_args->last_sequence) {
+            p_args->result.n_searched_sequences++;
+            if (p_args->first_sequence < 0) p_args->first_sequence = entry.sequence_index;
+            p_args->last_sequence = entry.sequence_index;
+        }
+        bool matched;
+        if (query.partial_scoring) {
+            candidate.sequence_index = entry.sequence_index;
+            matched = score_digest(context, protein, entry.digest, candidate);
+        } else {
+            match.sequence_index = entry.sequence_index;
+            match.protein = &protein;
+            matched = search_digest(context, protein, entry.digest, match);
+        }
+        if (matched) p_args->result.n_matched_sequences++;
+        p_args->result.n_digest_sequences++;
+
+        int begin, end;
+        protein.digest_range(query.gluc_digest, entry.digest, begin, end);
+        ++p_args->batch_items;
+        p_args->batch_residues += end - begin;
+    }
+    publish_progress(p_args);
+
+    return 0;
+}
+
+// The peptides of a database inside the query's precursor window, in database order
+static void collect_precursor_candidates(const Database &database, const SearchQuery &query, std::vector<PeptideEntry> &candidates)
+{
+    double min_mass = query.precursor_mass - query.precursor_tolerance;
+    double max_mass = query.precursor_mass + query.precursor_tolerance;
+    candidates.clear();
+    if (!database.peptide_table.empty() && database.peptide_table_gluc == query.gluc_digest) {
+        const PeptideEntry *begin, *end;
+        database.peptide_window(min_mass, max_mass, begin, end);
+        candidates.assign(begin, end);
+        std::sort(candidates.begin(), candidates.end(), [](const PeptideEntry &a, const PeptideEntry &b) {
+            return a.sequence_index != b.sequence_index ? a.sequence_index < b.sequence_index : a.digest < b.digest;
+        });
+        return;
+    }
+
+    // No usable table: check every digest's mass
+    for (int i = 0; i < (int)database.sequences.size(); i++) {
+        const Protein &protein = database.sequences[i];
+        if (!protein.indexed()) continue;
+        int n_digests = protein.digest_count(query.gluc_digest);
+        for (int digest = 0; digest < n_digests; digest++) {
+            int begin, end;
+            protein.digest_range(query.gluc_digest, digest, begin, end);
+            if (!protein.range_has_masses(begin, end)) continue;
+            double mass = residue_mass_sum(protein, begin, end) + peptide_water_mass;
+            if (mass < min_mass || mass > max_mass) continue;
+            PeptideEntry entry;
+            entry.mass = mass;
+            entry.sequence_index = i;
+            entry.digest = digest;
+            candidates.push_back(entry);
+        }
+    }
+}
+
+// NUMA node of the shard holding a sequence
+static int sequence_node(const Database &database, int sequence_index)
+{
+    for (const auto &shard : database.shards) {
+        if (sequence_index >= shard.begin && sequence_index < shard.end) return shard.node;
+    }
+    return 0;
+}
+
+Results search_databases(const std::vector<Database> &databases, const SearchQuery &query, const MatchCallback &on_match,
+    ThreadPool *pool, const CancellationToken *cancellation, SearchProgress *progress)
+{
+    if (query.partial_scoring && !query.target_intensities.empty() && query.target_intensities.size() != query.target_masses.size()) {
+        throw std::invalid_argument("target_intensities must have one value per target mass");
+    }
+
+    std::unique_ptr<WorkerThreadPool> default_pool;
+    if (!pool) {
+        default_pool.reset(new WorkerThreadPool());
+        pool = default_pool.get();
+    }
+    int n_threads = pool->size();
+    if (n_threads < 1) n_threads = 1;
+
+    // Matches come from every worker; hand them to the caller one at a time
+    std::mutex callback_mutex;
+    match_emitter emit = [&](const SearchMatch &match) {
+        std::lock_guard<std::mutex> lock(callback_mutex);
+        if (on_match) on_match(match);
+    };
+
+    // The budget clock starts now, before the tasks are set up. Budgets too large to convert
+    // (or NaN) are as good as unlimited.
+    SearchProgress default_progress;
+    search_budget budget;
+    budget.progress = progress ? progress : &default_progress;
+    budget.has_deadline = query.time_budget_seconds > 0 && query.time_budget_seconds < max_time_budget_seconds;
+    if (budget.has_deadline) {
+        budget.deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(query.time_budget_seconds));
+    }
+    budget.max_residues = query.residue_budget > 0 && query.residue_budget < max_residue_budget ? (uint64_t)query.residue_budget : 0;
+    std::vector<query_prefilter> prefilters;
+    prefilters.reserve(databases.size());
+    for (const auto &db : databases) {
+        prefilters.push_back(build_query_prefilter(query, db));
+    }
+
+    // With a precursor window, only the peptides inside it are searched
+    bool precursor_window = query.precursor_mass > 0;
+    std::vector<std::vector<PeptideEntry>> candidates(databases.size());
+    uint64_t total_sequences = 0, total_residues = 0;
+    for (int database_index = 0; database_index < (int)databases.size(); database_index++) {
+        const auto &db = databases[database_index];
+        if (!precursor_window) {
+            total_sequences += db.sequences.size();
+            for (const auto &protein : db.sequences) {
+                total_residues += protein.sequence.size();
+            }
+            continue;
+        }
+        collect_precursor_candidates(db, query, candidates[database_index]);
+        total_sequences += candidates[database_index].size();
+        for (const auto &entry : candidates[database_index]) {
+            int begin, end;
+            db.sequences[entry.sequence_index].digest_range(query.gluc_digest, entry.digest, begin, end);
+            total_residues += end - begin;
+        }
+    }
+    budget.progress->total_sequences = total_sequences;
+    budget.progress->total_residues = total_residues;
+
+    // Allocate memory to store the input information for each task + its results.
+    // Each database shard (NUMA node) is split into ranges of sequences, one per thread working on it.
+    std::vector<struct helper_thread_args_struct> thread_args;
+    std::vector<int> task_nodes;
+    for (int database_index = 0; database_index < (int)databases.size(); database_index++) {
+        const auto &db = databases[database_index];
+        if (precursor_window) {
+            // Candidate peptides are split evenly over the threads (kept whole if there are only a few)
+            const std::vector<PeptideEntry> &window = candidates[database_index];
+            int n_candidates = (int)window.size();
+            int n_chunks = std::max(1, std::min(n_threads, n_candidates / progress_batch_size));
+            for (int i = 0; i < n_chunks && n_candidates > 0; i++) {
+                struct helper_thread_args_struct args(db, query, prefilters[database_index], emit, budget);
+                args.cancellation = cancellation;
+                args.database_index = database_index;
+                args.candidates = &window;
+                args.start_index = (int)((int64_t)n_candidates * i / n_chunks);
+                args.stop_index = (int)((int64_t)n_candidates * (i + 1) / n_chunks) - 1;
+                thread_args.push_back(args);
+                task_nodes.push_back(sequence_node(db, window[args.start_index].sequence_index));
+            }
+            continue;
+        }
+        int n_shards = (int)db.shards.size();
+        for (const auto &shard : db.shards) {
+            int n_chunks = std::max(1, n_threads / n_shards);
+            int sequences_seen = shard.end - shard.begin;
+            // Setup how many sequences each thread needs to search
+            int n_sequences_per_thread = sequences_seen / n_chunks;
+            int excess = sequences_seen - (n_sequences_per_thread * n_chunks);
+
+            for (int i = 0; i < n_chunks; i++) {
+                // Setup input arguments for each thread
+                struct helper_thread_args_struct args(db, query, prefilters[database_index], emit, budget);
+                args.cancellation = cancellation;
+                args.database_index = database_index;
+                args.start_index = shard.begin + i * n_sequences_per_thread;
+                args.stop_index = shard.begin + (i + 1) * n_sequences_per_thread - 1;
+                if (i + 1 == n_chunks) args.stop_index += excess;
+                thread_args.push_back(args);
+                task_nodes.push_back(shard.node);
+            }
+        }
+    }
+
+    pool->run_placed((int)thread_args.size(), [&](int i) {
+        if (thread_args[i].candidates) PrecursorThreadProc(&thread_args[i]);
+        else SearchThreadProc(&thread_args[i]);
+    }, task_nodes);
+
+    // All the tasks are done now, add up the results (in database order)
+    std::vector<Results> thread_results;
+    thread_results.reserve(thread_args.size());
+    std::vector<scored_peptide> top_peptides;
+    for (auto &args : thread_args) {
+        thread_results.push_back(std::move(args.result));
+        top_peptides.insert(top_peptides.end(), args.top_peptides.begin(), args.top_peptides.end());
+    }
+    Results results = Results::Combine(thread_results);
+
+    // With a precursor window, each task counted the sequences it scored a candidate of. Candidates are in
+    // sequence order, so a sequence split between neighbouring tasks was counted by both.
+    for (size_t i = 1; i < thread_args.size(); i++) {
+        const auto &previous = thread_args[i - 1];
+        const auto &current = thread_args[i];
+        if (current.candidates && current.candidates == previous.candidates && current.first_sequence >= 0 &&
+            current.first_sequence == previous.last_sequence) {
+            results.n_searched_sequences--;
+        }
+    }
+
+    // Merge the per-thread heaps and deliver the best peptides
+    std::sort(top_peptides.begin(), top_peptides.end(), better_peptide);
+    if ((int)top_peptides.size() > query.top_k) top_peptides.resize(query.top_k);
+    for (const auto &peptide : top_peptides) {
+        SearchMatch match;
+        match.database_index = peptide.database_index;
+        match.sequence_index = peptide.sequence_index;
+        match.database = &databases[peptide.database_index];
+        match.protein = &match.database->sequences[peptide.sequence_index];
+        match.begin = peptide.begin;
+        match.end = peptide.end;
+        match.score = peptide.score;
+        match.n_matched_targets = peptide.n_matched;
+        emit(match);
+    }
+    return results;
+}
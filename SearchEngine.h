@@ -0,0 +1,174 @@
+#ifndef SEARCH_ENGINE_H
+#define SEARCH_ENGINE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Configuration.h"
+#include "Database.h"
+#include "Results.h"
+
+// Reentrant library interface: load the databases once, then run any number of (concurrent)
+// searches against them. Searches never modify the databases.
+
+// Search parameters; build one in code, or from a Configuration
+class SearchQuery
+{
+public:
+    std::vector<double> target_masses;
+    double mass_tolerance;
+    bool gluc_digest;
+
+    // Precursor window (see Configuration): only peptides with intact mass within precursor_tolerance of
+    // precursor_mass are searched (0 = no window). Uses the databases' peptide tables when they were
+    // built for the same digest mode, otherwise scans every digest's mass.
+    double precursor_mass;
+    double precursor_tolerance;
+
+    // Partial-match scoring (see Configuration)
+    bool partial_scoring;
+    int top_k;
+    int min_matched_targets;
+    std::vector<double> target_intensities;
+
+    // Also search a decoy of every digest; decoy hits are only counted (Results::n_decoy_matches), never reported
+    DecoyMode decoy_mode;
+
+    // Stop early once either budget is used up (0, or 1e9 s / 2^64 residues and above = unlimited);
+    // the work budget counts residues.
+    // Checked every few sequences per worker, so a search can overshoot them slightly.
+    double time_budget_seconds;
+    double residue_budget;
+
+    // Use the databases' mass-bin signatures (if they were built for this digest mode) to skip peptides early
+    bool mass_prefilter;
+
+    // Fill in the per-sequence length vectors of Results (O(database size) memory per search)
+    bool collect_length_statistics;
+
+public:
+    SearchQuery();
+
+    static SearchQuery FromConfiguration(const Configuration &config);
+};
+
+// Handle to a set of loaded databases. Immutable once loaded, so one instance can be shared by
+// any number of threads and searches.
+class DatabaseSet
+{
+public:
+    std::vector<Database> databases;
+
+public:
+    static std::shared_ptr<const DatabaseSet> Load(const Configuration &config);
+};
+
+// Set from any thread to make a running search stop early; the search returns what it found so far
+class CancellationToken
+{
+public:
+    CancellationToken();
+
+    void cancel();
+    bool cancelled() const;
+
+private:
+    std::atomic<bool> flag;
+};
+
+// Live counters of a running search, updated by the workers without locking; poll from any thread
+class SearchProgress
+{
+public:
+    std::atomic<uint64_t> n_sequences;      // Sequences searched (or skipped) so far; candidate peptides with a precursor window
+    std::atomic<uint64_t> n_residues;       // Residues in those sequences (or peptides)
+    std::atomic<uint64_t> total_sequences;  // Set when the search starts
+    std::atomic<uint64_t> total_residues;
+
+public:
+    SearchProgress();
+};
+
+// Executes the search tasks. Callers can supply their own pool by implementing run(), which must
+// call task(i) once for every i in [0, n_tasks) and only return once all of them have finished.
+class ThreadPool
+{
+public:
+    virtual ~ThreadPool() {}
+
+    virtual int size() const = 0;
+    virtual void run(int n_tasks, const std::function<void(int)> &task) = 0;
+
+    // As run(), but task_nodes[i] is the NUMA node (index into NumaTopology) holding task i's data.
+    // Pools that don't track placement can ignore it.
+    virtual void run_placed(int n_tasks, const std::function<void(int)> &task, const std::vector<int> &task_nodes)
+    {
+        (void)task_nodes;
+        this->run(n_tasks, task);
+    }
+};
+
+// Default pool: persistent worker threads, shared by successive run() calls, optionally pinned to CPUs
+class WorkerThreadPool : public ThreadPool
+{
+public:
+    // n_threads = 0: one per hardware thread
+    WorkerThreadPool(int n_threads = 0, ThreadAffinity affinity = ThreadAffinity::None);
+    ~WorkerThreadPool();
+
+    int size() const override;
+    void run(int n_tasks, const std::function<void(int)> &task) override;
+
+    // Pinned workers take the tasks on their own node first, then help with the other nodes' tasks
+    void run_placed(int n_tasks, const std::function<void(int)> &task, const std::vector<int> &task_nodes) override;
+
+private:
+    ThreadAffinity affinity;
+    std::vector<std::thread> workers;
+    std::vector<int> worker_nodes;
+    std::mutex run_mutex;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    const std::function<void(int)> *job;
+    size_t n_idle;
+    uint64_t generation;
+    bool stopping;
+
+    // Run job(worker) once on every worker and wait for them all
+    void run_on_workers(const std::function<void(int)> &job);
+    void worker_loop(int worker);
+};
+
+// A matching peptide: residues [begin, end) of a database sequence
+class SearchMatch
+{
+public:
+    int database_index;
+    int sequence_index;
+    const Database *database;
+    const Protein *protein;
+    int begin;
+    int end;
+    double score;
+    int n_matched_targets;
+};
+
+typedef std::function<void(const SearchMatch &match)> MatchCallback;
+
+// Run a search. Matches are streamed through on_match; calls are serialized, so the callback
+// needn't be thread-safe. Exact matches arrive as they are found, in no particular order;
+// partial-scoring matches arrive best first once the search has finished.
+// The returned Results holds the counters (matches and top_matches are left empty); Results::cancelled
+// is set if the search was cancelled or ran out of budget.
+// With no pool, a temporary pool with one thread per hardware thread is used.
+Results search_databases(const std::vector<Database> &databases, const SearchQuery &query, const MatchCallback &on_match,
+    ThreadPool *pool = nullptr, const CancellationToken *cancellation = nullptr, SearchProgress *progress = nullptr);
+
+#endif // SEARCH_ENGINE_H
@@ -62,9 +62,16 @@ int main(int argc, char *argv[])
         fputc('\n', stdout);
 
         fprintf(stdout, "%d matches, %d searched sequences, %d digests, %d skipped (%d total) (%lf%%).\n",
-            matching_sequences, searched_sequences, digest_sequences, skipped_sequences, total_sequences, (double)matching_sequences / digest_sequences * 100);
+            matching_sequences, searched_sequences, digest_sequences, skipped_sequences, total_sequences, digest_sequences ? (double)matching_sequences / digest_sequences * 100 : 0.0);
 
-        // Stats on sequence lengths
+        // Target-decoy estimate: as many false target hits are expected as there were decoy hits
+        if (configuration.decoy_mode != DecoyMode::None) {
+            int decoy_matches = final_results.n_decoy_matches;
+            fprintf(stdout, "%d decoy matches, estimated FDR = %lf%%.\n", decoy_matches, matching_sequences ? (double)decoy_matches / matching_sequences * 100 : 0.0);
+        }
+
+        // Stats on sequence lengths (not available when the results were served from the cache)
+        if (final_results.searched_sequence_lengths.empty()) return 0;
         auto minmax_sequence_lengths = std::minmax_element(final_results.searched_sequence_lengths.begin(), final_results.searched_sequence_lengths.end());
         auto min_sequence_length = *minmax_sequence_lengths.first;
         auto max_sequence_length = *minmax_sequence_lengths.second;